@@ -0,0 +1,267 @@
+/*
+What we know about desktop files, loaded without blocking the panel.
+
+Copyright 2017 Ayatana Indicators Project
+
+This program is free software: you can redistribute it and/or modify it 
+under the terms of the GNU General Public License version 3, as published 
+by the Free Software Foundation.
+
+This program is distributed in the hope that it will be useful, but 
+WITHOUT ANY WARRANTY; without even the implied warranties of 
+MERCHANTABILITY, SATISFACTORY QUALITY, or FITNESS FOR A PARTICULAR 
+PURPOSE.  See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along 
+with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <gio/gio.h>
+
+#include "desktop-cache.h"
+
+/* Entries are keyed by path and remember the modification time of
+   the file they were read from.  Once something is in the cache a
+   lookup never touches the disk, the file gets checked again in the
+   background when the entry is older than DESKTOP_CACHE_REVALIDATE. */
+
+#define DESKTOP_CACHE_REVALIDATE  (30 * G_TIME_SPAN_SECOND)
+
+typedef struct _Waiter Waiter;
+struct _Waiter {
+	DesktopCacheNameFunc func;
+	gpointer user_data;
+};
+
+typedef struct _CacheEntry CacheEntry;
+struct _CacheEntry {
+	gchar * path;
+	gchar * name;
+	guint64 mtime;
+	gint64 validated;
+	gboolean loaded;
+	gboolean busy;
+	DesktopCacheStubs stubs;
+	GArray * waiters;
+};
+
+static GHashTable * cache = NULL;
+
+static CacheEntry *
+entry_get (const gchar * path)
+{
+	if (cache == NULL) {
+		cache = g_hash_table_new(g_str_hash, g_str_equal);
+	}
+
+	CacheEntry * entry = g_hash_table_lookup(cache, path);
+	if (entry != NULL) {
+		return entry;
+	}
+
+	entry = g_new0(CacheEntry, 1);
+	entry->path = g_strdup(path);
+	entry->stubs = DESKTOP_CACHE_STUBS_UNKNOWN;
+	entry->waiters = g_array_new(FALSE, FALSE, sizeof(Waiter));
+
+	g_hash_table_insert(cache, entry->path, entry);
+
+	return entry;
+}
+
+/* Tell everyone waiting on the first load */
+static void
+entry_loaded (CacheEntry * entry)
+{
+	entry->loaded = TRUE;
+	entry->busy = FALSE;
+	entry->validated = g_get_monotonic_time();
+
+	/* Callbacks may look things up again, work from a copy */
+	GArray * waiters = entry->waiters;
+	entry->waiters = g_array_new(FALSE, FALSE, sizeof(Waiter));
+
+	guint i;
+	for (i = 0; i < waiters->len; i++) {
+		Waiter * waiter = &g_array_index(waiters, Waiter, i);
+		waiter->func(entry->path, entry->name, waiter->user_data);
+	}
+
+	g_array_free(waiters, TRUE);
+	return;
+}
+
+static void
+entry_contents_cb (GObject * object, GAsyncResult * res, gpointer user_data)
+{
+	CacheEntry * entry = (CacheEntry *)user_data;
+	GError * error = NULL;
+	gchar * contents = NULL;
+	gsize length = 0;
+
+	if (!g_file_load_contents_finish(G_FILE(object), res, &contents, &length, NULL, &error)) {
+		g_debug("Unable to read desktop file '%s': %s", entry->path, error->message);
+		g_error_free(error);
+		entry_loaded(entry);
+		return;
+	}
+
+	GKeyFile * keyfile = g_key_file_new();
+
+	if (g_key_file_load_from_data(keyfile, contents, length, G_KEY_FILE_NONE, &error)) {
+		g_free(entry->name);
+		entry->name = g_key_file_get_locale_string(keyfile, G_KEY_FILE_DESKTOP_GROUP, G_KEY_FILE_DESKTOP_KEY_NAME, NULL, NULL);
+	} else {
+		g_debug("Unable to parse desktop file '%s': %s", entry->path, error->message);
+		g_error_free(error);
+	}
+
+	g_key_file_free(keyfile);
+	g_free(contents);
+
+	entry_loaded(entry);
+	return;
+}
+
+static void
+entry_info_cb (GObject * object, GAsyncResult * res, gpointer user_data)
+{
+	CacheEntry * entry = (CacheEntry *)user_data;
+	GError * error = NULL;
+	guint64 mtime = 0;
+
+	GFileInfo * info = g_file_query_info_finish(G_FILE(object), res, &error);
+	if (info != NULL) {
+		mtime = g_file_info_get_attribute_uint64(info, G_FILE_ATTRIBUTE_TIME_MODIFIED);
+		g_object_unref(info);
+	} else {
+		g_debug("Unable to stat desktop file '%s': %s", entry->path, error->message);
+		g_error_free(error);
+	}
+
+	/* Nothing changed, keep what we have */
+	if (entry->loaded && mtime == entry->mtime) {
+		entry->busy = FALSE;
+		entry->validated = g_get_monotonic_time();
+		return;
+	}
+
+	entry->mtime = mtime;
+	g_file_load_contents_async(G_FILE(object), NULL, entry_contents_cb, entry);
+
+	return;
+}
+
+/* Start looking at the file, if we aren't already */
+static void
+entry_query (CacheEntry * entry)
+{
+	if (entry->busy) {
+		return;
+	}
+
+	entry->busy = TRUE;
+
+	GFile * file = g_file_new_for_path(entry->path);
+	g_file_query_info_async(file,
+	                        G_FILE_ATTRIBUTE_TIME_MODIFIED,
+	                        G_FILE_QUERY_INFO_NONE,
+	                        G_PRIORITY_DEFAULT,
+	                        NULL,
+	                        entry_info_cb,
+	                        entry);
+	g_object_unref(file);
+
+	return;
+}
+
+/* Returns TRUE and sets @name when the name is already known.
+   Otherwise the file gets loaded in the background and @func is
+   called when it is. */
+gboolean
+desktop_cache_lookup_name (const gchar * path, const gchar ** name, DesktopCacheNameFunc func, gpointer user_data)
+{
+	g_return_val_if_fail(path != NULL, FALSE);
+	g_return_val_if_fail(name != NULL, FALSE);
+
+	CacheEntry * entry = entry_get(path);
+
+	if (entry->loaded) {
+		if (g_get_monotonic_time() - entry->validated > DESKTOP_CACHE_REVALIDATE) {
+			entry_query(entry);
+		}
+
+		*name = entry->name;
+		return TRUE;
+	}
+
+	if (func != NULL) {
+		Waiter waiter = { func, user_data };
+		g_array_append_val(entry->waiters, waiter);
+	}
+
+	entry_query(entry);
+
+	*name = NULL;
+	return FALSE;
+}
+
+/* Drop all the callbacks waiting with @user_data */
+void
+desktop_cache_cancel (gpointer user_data)
+{
+	if (cache == NULL) {
+		return;
+	}
+
+	GHashTableIter iter;
+	gpointer value;
+
+	g_hash_table_iter_init(&iter, cache);
+	while (g_hash_table_iter_next(&iter, NULL, &value)) {
+		CacheEntry * entry = (CacheEntry *)value;
+		guint i = 0;
+
+		while (i < entry->waiters->len) {
+			if (g_array_index(entry->waiters, Waiter, i).user_data == user_data) {
+				g_array_remove_index_fast(entry->waiters, i);
+			} else {
+				i++;
+			}
+		}
+	}
+
+	return;
+}
+
+/* Whether the menu stubs policy has already been worked out for
+   this desktop file */
+DesktopCacheStubs
+desktop_cache_get_stubs (const gchar * path)
+{
+	g_return_val_if_fail(path != NULL, DESKTOP_CACHE_STUBS_UNKNOWN);
+
+	if (cache == NULL) {
+		return DESKTOP_CACHE_STUBS_UNKNOWN;
+	}
+
+	CacheEntry * entry = g_hash_table_lookup(cache, path);
+	if (entry == NULL) {
+		return DESKTOP_CACHE_STUBS_UNKNOWN;
+	}
+
+	return entry->stubs;
+}
+
+void
+desktop_cache_set_stubs (const gchar * path, DesktopCacheStubs stubs)
+{
+	g_return_if_fail(path != NULL);
+
+	entry_get(path)->stubs = stubs;
+	return;
+}
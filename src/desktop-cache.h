@@ -0,0 +1,45 @@
+/*
+What we know about desktop files, loaded without blocking the panel.
+
+Copyright 2017 Ayatana Indicators Project
+
+This program is free software: you can redistribute it and/or modify it 
+under the terms of the GNU General Public License version 3, as published 
+by the Free Software Foundation.
+
+This program is distributed in the hope that it will be useful, but 
+WITHOUT ANY WARRANTY; without even the implied warranties of 
+MERCHANTABILITY, SATISFACTORY QUALITY, or FITNESS FOR A PARTICULAR 
+PURPOSE.  See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along 
+with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __DESKTOP_CACHE_H__
+#define __DESKTOP_CACHE_H__
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/* Called once the name of a desktop file has been loaded, @name is
+   NULL if the file couldn't be read or doesn't have one */
+typedef void (*DesktopCacheNameFunc) (const gchar * path, const gchar * name, gpointer user_data);
+
+typedef enum _DesktopCacheStubs DesktopCacheStubs;
+enum _DesktopCacheStubs {
+	DESKTOP_CACHE_STUBS_UNKNOWN,
+	DESKTOP_CACHE_STUBS_SHOW,
+	DESKTOP_CACHE_STUBS_HIDE
+};
+
+gboolean desktop_cache_lookup_name (const gchar * path, const gchar ** name, DesktopCacheNameFunc func, gpointer user_data);
+void desktop_cache_cancel (gpointer user_data);
+
+DesktopCacheStubs desktop_cache_get_stubs (const gchar * path);
+void desktop_cache_set_stubs (const gchar * path, DesktopCacheStubs stubs);
+
+G_END_DECLS
+
+#endif
@@ -0,0 +1,146 @@
+/*
+Fixed size records for the entries of a window's menus.
+
+Copyright 2017 Ayatana Indicators Project
+
+This program is free software: you can redistribute it and/or modify it 
+under the terms of the GNU General Public License version 3, as published 
+by the Free Software Foundation.
+
+This program is distributed in the hope that it will be useful, but 
+WITHOUT ANY WARRANTY; without even the implied warranties of 
+MERCHANTABILITY, SATISFACTORY QUALITY, or FITNESS FOR A PARTICULAR 
+PURPOSE.  See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along 
+with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <string.h>
+
+#include "entry-slab.h"
+
+/* Records are cut from chunks that stay around until the slab is
+   destroyed.  Freed records go on a list threaded through their first
+   word and are handed out again before a new chunk is made, so a menu
+   that keeps getting rebuilt reuses the same memory. */
+
+#define RECORDS_PER_CHUNK  16
+
+struct _EntrySlab {
+	gsize record_size;
+	GSList * chunks;
+	gpointer free_list;
+
+	guint allocated;
+	guint in_use;
+	guint chunk_count;
+};
+
+EntrySlab *
+entry_slab_new (gsize record_size)
+{
+	EntrySlab * slab = g_new0(EntrySlab, 1);
+
+	record_size = MAX(record_size, sizeof(gpointer));
+	slab->record_size = (record_size + G_MEM_ALIGN - 1) & ~((gsize)G_MEM_ALIGN - 1);
+
+	return slab;
+}
+
+/* Gives back all the memory at once, records still in use go with it */
+void
+entry_slab_destroy (EntrySlab * slab)
+{
+	g_return_if_fail(slab != NULL);
+
+	if (slab->in_use != 0) {
+		g_debug("Destroying entry slab with %u records in use", slab->in_use);
+	}
+
+	g_slist_free_full(slab->chunks, g_free);
+	g_free(slab);
+
+	return;
+}
+
+static void
+slab_grow (EntrySlab * slab)
+{
+	guchar * chunk = g_malloc(slab->record_size * RECORDS_PER_CHUNK);
+	gint i;
+
+	slab->chunks = g_slist_prepend(slab->chunks, chunk);
+	slab->chunk_count++;
+
+	/* Backwards so they're handed out in address order */
+	for (i = RECORDS_PER_CHUNK - 1; i >= 0; i--) {
+		gpointer record = chunk + i * slab->record_size;
+		*(gpointer *)record = slab->free_list;
+		slab->free_list = record;
+	}
+
+	return;
+}
+
+/* A zeroed record */
+gpointer
+entry_slab_alloc (EntrySlab * slab)
+{
+	g_return_val_if_fail(slab != NULL, NULL);
+
+	if (slab->free_list == NULL) {
+		slab_grow(slab);
+	}
+
+	gpointer record = slab->free_list;
+	slab->free_list = *(gpointer *)record;
+	memset(record, 0, slab->record_size);
+
+	slab->allocated++;
+	slab->in_use++;
+
+	return record;
+}
+
+void
+entry_slab_free (EntrySlab * slab, gpointer record)
+{
+	g_return_if_fail(slab != NULL);
+
+	if (record == NULL) {
+		return;
+	}
+
+	g_return_if_fail(slab->in_use > 0);
+
+	*(gpointer *)record = slab->free_list;
+	slab->free_list = record;
+	slab->in_use--;
+
+	return;
+}
+
+/* Records handed out over the slab's life, the ones out now and the
+   chunks holding them */
+void
+entry_slab_get_stats (EntrySlab * slab, guint * allocated, guint * in_use, guint * chunks)
+{
+	g_return_if_fail(slab != NULL);
+
+	if (allocated != NULL) {
+		*allocated = slab->allocated;
+	}
+	if (in_use != NULL) {
+		*in_use = slab->in_use;
+	}
+	if (chunks != NULL) {
+		*chunks = slab->chunk_count;
+	}
+
+	return;
+}
@@ -0,0 +1,39 @@
+/*
+Fixed size records for the entries of a window's menus.
+
+Copyright 2017 Ayatana Indicators Project
+
+This program is free software: you can redistribute it and/or modify it 
+under the terms of the GNU General Public License version 3, as published 
+by the Free Software Foundation.
+
+This program is distributed in the hope that it will be useful, but 
+WITHOUT ANY WARRANTY; without even the implied warranties of 
+MERCHANTABILITY, SATISFACTORY QUALITY, or FITNESS FOR A PARTICULAR 
+PURPOSE.  See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along 
+with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef __ENTRY_SLAB_H__
+#define __ENTRY_SLAB_H__
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+typedef struct _EntrySlab EntrySlab;
+
+EntrySlab * entry_slab_new (gsize record_size);
+void entry_slab_destroy (EntrySlab * slab);
+
+gpointer entry_slab_alloc (EntrySlab * slab);
+void entry_slab_free (EntrySlab * slab, gpointer record);
+
+void entry_slab_get_stats (EntrySlab * slab, guint * allocated, guint * in_use, guint * chunks);
+
+G_END_DECLS
+
+#endif
@@ -0,0 +1,194 @@
+/*
+Decoded menu icons, shared by every window in the process.
+
+Copyright 2017 Ayatana Indicators Project
+
+This program is free software: you can redistribute it and/or modify it 
+under the terms of the GNU General Public License version 3, as published 
+by the Free Software Foundation.
+
+This program is distributed in the hope that it will be useful, but 
+WITHOUT ANY WARRANTY; without even the implied warranties of 
+MERCHANTABILITY, SATISFACTORY QUALITY, or FITNESS FOR A PARTICULAR 
+PURPOSE.  See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along 
+with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "icon-cache.h"
+
+/* Icons are keyed by a checksum of their bytes, so the same icon from
+   different items, windows or applications is kept once.  The key also
+   says who made the pixbuf, dbusmenu-gtk may have scaled its copy while
+   ours is the image as decoded.  Named icons don't need us, the icon
+   theme caches those.  The least recently used ones are dropped once
+   there are more than ICON_CACHE_SIZE. */
+
+#define ICON_CACHE_SIZE          256
+#define ICON_CACHE_REPORT_EVERY  256 /* lookups */
+
+typedef struct _CacheNode CacheNode;
+struct _CacheNode {
+	gchar * key;
+	GdkPixbuf * pixbuf;
+	GList link;
+};
+
+static GHashTable * cache = NULL;
+static GQueue lru = G_QUEUE_INIT;
+static guint hits = 0;
+static guint misses = 0;
+
+static void
+node_free (gpointer data)
+{
+	CacheNode * node = (CacheNode *)data;
+
+	g_queue_unlink(&lru, &node->link);
+	g_object_unref(node->pixbuf);
+	g_free(node->key);
+	g_free(node);
+
+	return;
+}
+
+static void
+cache_init (void)
+{
+	if (cache != NULL) {
+		return;
+	}
+
+	cache = g_hash_table_new_full(g_str_hash, g_str_equal, NULL, node_free);
+
+	return;
+}
+
+static GdkPixbuf *
+cache_lookup (const gchar * key)
+{
+	cache_init();
+
+	if ((hits + misses + 1) % ICON_CACHE_REPORT_EVERY == 0) {
+		g_debug("Icon cache: %u hits, %u misses, %u icons", hits, misses, g_hash_table_size(cache));
+	}
+
+	CacheNode * node = g_hash_table_lookup(cache, key);
+	if (node == NULL) {
+		misses++;
+		return NULL;
+	}
+
+	hits++;
+
+	/* Most recent goes to the head */
+	g_queue_unlink(&lru, &node->link);
+	g_queue_push_head_link(&lru, &node->link);
+
+	return g_object_ref(node->pixbuf);
+}
+
+/* Takes the key */
+static void
+cache_insert (gchar * key, GdkPixbuf * pixbuf)
+{
+	cache_init();
+
+	CacheNode * node = g_new0(CacheNode, 1);
+	node->key = key;
+	node->pixbuf = g_object_ref(pixbuf);
+	node->link.data = node;
+
+	/* Replacing frees the old node, which unlinks it */
+	g_hash_table_replace(cache, node->key, node);
+	g_queue_push_head_link(&lru, &node->link);
+
+	while (g_queue_get_length(&lru) > ICON_CACHE_SIZE) {
+		CacheNode * oldest = (CacheNode *)g_queue_peek_tail(&lru);
+		g_hash_table_remove(cache, oldest->key);
+	}
+
+	return;
+}
+
+static gchar *
+data_key (const gchar * producer, const guchar * data, gsize length)
+{
+	gchar * checksum = g_compute_checksum_for_data(G_CHECKSUM_SHA1, data, length);
+	gchar * key = g_strconcat(producer, ":", checksum, NULL);
+	g_free(checksum);
+	return key;
+}
+
+/* The pixbuf @producer made from some encoded image data, if we've
+   seen it before */
+GdkPixbuf *
+icon_cache_lookup_data (const gchar * producer, const guchar * data, gsize length)
+{
+	g_return_val_if_fail(producer != NULL, NULL);
+	g_return_val_if_fail(data != NULL, NULL);
+
+	gchar * key = data_key(producer, data, length);
+	GdkPixbuf * pixbuf = cache_lookup(key);
+	g_free(key);
+
+	return pixbuf;
+}
+
+/* Remember a pixbuf that @producer made from @data */
+void
+icon_cache_insert_data (const gchar * producer, const guchar * data, gsize length, GdkPixbuf * pixbuf)
+{
+	g_return_if_fail(producer != NULL);
+	g_return_if_fail(data != NULL);
+	g_return_if_fail(GDK_IS_PIXBUF(pixbuf));
+
+	cache_insert(data_key(producer, data, length), pixbuf);
+	return;
+}
+
+/* Decode image data, unless we already have */
+GdkPixbuf *
+icon_cache_load_data (const guchar * data, gsize length)
+{
+	g_return_val_if_fail(data != NULL, NULL);
+
+	gchar * key = data_key("decoded", data, length);
+	GdkPixbuf * pixbuf = cache_lookup(key);
+	if (pixbuf != NULL) {
+		g_free(key);
+		return pixbuf;
+	}
+
+	GError * error = NULL;
+	GdkPixbufLoader * loader = gdk_pixbuf_loader_new();
+
+	gboolean written = gdk_pixbuf_loader_write(loader, data, length, &error);
+
+	if (written && gdk_pixbuf_loader_close(loader, &error)) {
+		pixbuf = gdk_pixbuf_loader_get_pixbuf(loader);
+	} else {
+		g_warning("Unable to decode icon data: %s", error->message);
+		g_error_free(error);
+
+		/* A failed close has already closed it */
+		if (!written) {
+			gdk_pixbuf_loader_close(loader, NULL);
+		}
+	}
+
+	if (pixbuf != NULL) {
+		g_object_ref(pixbuf);
+		cache_insert(key, pixbuf);
+	} else {
+		g_free(key);
+	}
+
+	g_object_unref(loader);
+	return pixbuf;
+}
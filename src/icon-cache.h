@@ -0,0 +1,32 @@
+/*
+Decoded menu icons, shared by every window in the process.
+
+Copyright 2017 Ayatana Indicators Project
+
+This program is free software: you can redistribute it and/or modify it 
+under the terms of the GNU General Public License version 3, as published 
+by the Free Software Foundation.
+
+This program is distributed in the hope that it will be useful, but 
+WITHOUT ANY WARRANTY; without even the implied warranties of 
+MERCHANTABILITY, SATISFACTORY QUALITY, or FITNESS FOR A PARTICULAR 
+PURPOSE.  See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along 
+with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __ICON_CACHE_H__
+#define __ICON_CACHE_H__
+
+#include <gtk/gtk.h>
+
+G_BEGIN_DECLS
+
+GdkPixbuf * icon_cache_lookup_data (const gchar * producer, const guchar * data, gsize length);
+void icon_cache_insert_data (const gchar * producer, const guchar * data, gsize length, GdkPixbuf * pixbuf);
+GdkPixbuf * icon_cache_load_data (const guchar * data, gsize length);
+
+G_END_DECLS
+
+#endif
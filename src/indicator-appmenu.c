@@ -48,6 +48,9 @@ with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include "window-menu.h"
 #include "window-menu-dbusmenu.h"
 #include "window-menu-model.h"
+#include "desktop-cache.h"
+#include "registry-snapshot.h"
+#include "xid-table.h"
 #include "dbus-shared.h"
 #include "gdk-get-func.h"
 
@@ -78,6 +81,16 @@ enum _ActiveStubsState {
 	STUBS_HIDE
 };
 
+/* What's left of a window whose menus were dropped for not being
+   used, enough to answer the registrar and build them again */
+typedef struct _HibernatedWindow HibernatedWindow;
+struct _HibernatedWindow {
+	guint16 backend;
+	gchar * address;
+	gchar * path;
+	gchar ** labels;
+};
+
 typedef enum _AppmenuMode AppmenuMode;
 enum _AppmenuMode {
 	MODE_STANDARD,
@@ -95,7 +108,17 @@ struct _IndicatorAppmenu {
 	AppmenuMode mode;
 
 	WindowMenu * default_app;
-	GHashTable * apps;
+
+	/* Every window we know something about: its menus, which we hold
+	   a reference to, and whether it's a desktop window */
+	XidTable * windows;
+
+	/* Dialogs and other transients mapped to the XID of the window
+	   whose menus they show */
+	XidTable * transient_owners;
+
+	/* Every BAMF window we've seen, weakly referenced */
+	XidTable * bamf_windows;
 
 	BamfMatcher * matcher;
 	BamfWindow * active_window;
@@ -104,14 +127,88 @@ struct _IndicatorAppmenu {
 	GtkMenuItem * close_item;
 	GArray * window_menus;
 
-	GHashTable * desktop_windows;
 	WindowMenu * desktop_menu;
 
 	GDBusConnection * bus;
 	guint owner_id;
 	guint dbus_registration;
+
+	/* Registrar method calls are dispatched on their own thread so
+	   queries never wait on the panel's main loop */
+	GMainContext * worker_context;
+	GMainLoop * worker_loop;
+	GThread * worker;
+	gboolean disposed;
+
+	/* What the worker answers queries from, replaced as a whole
+	   whenever the set of menus changes */
+	GMutex registry_lock;
+	RegistrySnapshot * registry;
+	guint registry_idle;
+	gint default_xid;
+
+	/* NULL when the schema isn't installed */
+	GSettings * settings;
+
+	/* A focus change waiting to see if another one follows it,
+	   the window is weakly pointed to */
+	guint focus_timer;
+	BamfWindow * focus_pending;
+
+	/* The menus the pending window already has, listened to so a
+	   menu key pressed in it doesn't wait on the timer */
+	WindowMenu * focus_pending_menus;
+
+	/* Windows that were already open when we loaded, looked at a few
+	   at a time once the name is requested.  Each holds a ref. */
+	GList * startup_windows;
+	guint startup_idle;
+	gint64 startup_begin;
+	guint startup_chunks;
+	guint startup_count;
+
+	/* Newly opened windows waiting to have their menus built before
+	   they're focused, each holds a ref.  Then the XIDs of the ones
+	   that got menus and haven't been focused yet. */
+	GQueue preload_queue;
+	guint preload_idle;
+	GArray * preloaded;
+
+	/* When each window with menus last had focus, in seconds, and
+	   the windows whose menus were dropped since */
+	GHashTable * focus_times;
+	GHashTable * hibernated;
+	guint hibernate_timer;
+#if GLIB_CHECK_VERSION(2,64,0)
+	GMemoryMonitor * memory_monitor;
+#endif
+	guint hibernate_total;
+	guint hibernate_woken;
+	guint hibernate_entries;
 };
 
+#define SETTINGS_SCHEMA             "org.ayatana.indicator.appmenu"
+#define SETTINGS_DBUSMENU_LAYOUT    "dbusmenu-layout"
+#define SETTINGS_MODEL_LAYOUT       "model-layout"
+#define SETTINGS_FOCUS_DEBOUNCE     "focus-debounce"
+#define SETTINGS_PRELOAD_MENUS      "preload-menus"
+#define SETTINGS_HIBERNATE_AFTER    "hibernate-after"
+
+#define FOCUS_DEBOUNCE_DEFAULT      100
+
+/* How long a startup scan chunk may hold the main loop */
+#define STARTUP_CHUNK_USEC          (4 * 1000)
+
+/* Bounds on menus built ahead of focus: windows waiting to be looked
+   at, and menus built that nobody has focused yet */
+#define PRELOAD_QUEUE_MAX           8
+#define PRELOAD_MAX                 8
+
+/* Minutes without focus before a window's menus are dropped, 0 for
+   never, and how often we look for them */
+#define HIBERNATE_AFTER_DEFAULT     0
+#define HIBERNATE_CHECK_INTERVAL    60
+
 
 /**********************
   Debug Proxy
@@ -159,6 +256,21 @@ static void switch_default_app                                       (IndicatorA
                                                                       WindowMenu * newdef,
                                                                       BamfWindow * active_window);
 static void find_relevant_windows                                    (IndicatorAppmenu * iapp);
+static void preload_window                                           (BamfMatcher * matcher,
+                                                                      BamfView * view,
+                                                                      gpointer user_data);
+static void preload_claim                                            (IndicatorAppmenu * iapp,
+                                                                      WindowMenu * menus);
+static void hibernated_free                                          (gpointer data);
+static gboolean hibernate_check                                      (gpointer user_data);
+static void note_focus                                               (IndicatorAppmenu * iapp,
+                                                                      guint32 xid);
+#if GLIB_CHECK_VERSION(2,64,0)
+static void low_memory_warning                                       (GMemoryMonitor * monitor,
+                                                                      GMemoryMonitorWarningLevel level,
+                                                                      gpointer user_data);
+#endif
+static gboolean find_relevant_windows_chunk                          (gpointer user_data);
 static void new_window                                               (BamfMatcher * matcher,
                                                                       BamfView * view,
                                                                       gpointer user_data);
@@ -171,6 +283,11 @@ static void window_entry_added                                       (WindowMenu
 static void window_entry_removed                                     (WindowMenu * mw,
                                                                       IndicatorObjectEntry * entry,
                                                                       IndicatorAppmenu * iapp);
+static void window_entry_moved                                       (WindowMenu * mw,
+                                                                      IndicatorObjectEntry * entry,
+                                                                      guint old_pos,
+                                                                      guint new_pos,
+                                                                      IndicatorAppmenu * iapp);
 static void window_status_changed                                    (WindowMenu * mw,
                                                                       DbusmenuStatus status,
                                                                       IndicatorAppmenu * iapp);
@@ -187,6 +304,9 @@ static void active_window_changed                                    (BamfMatche
                                                                       gpointer user_data);
 static WindowMenu * update_active_window                             (IndicatorAppmenu * appmenu,
                                                                       BamfWindow *window);
+static gboolean focus_timeout                                        (gpointer user_data);
+static void focus_commit                                             (IndicatorAppmenu * iapp);
+static void focus_release_menus                                      (IndicatorAppmenu * iapp);
 static GQuark error_quark                                            (void);
 static void bus_method_call                                          (GDBusConnection * connection,
                                                                       const gchar * sender,
@@ -202,12 +322,29 @@ static void on_bus_acquired                                          (GDBusConne
 static void on_name_lost                                             (GDBusConnection * connection,
                                                                       const gchar * name,
                                                                       gpointer user_data);
+static WindowMenu * lookup_menus                                     (IndicatorAppmenu * iapp,
+                                                                      guint32 xid);
+static void forget_transients                                        (IndicatorAppmenu * iapp,
+                                                                      guint32 xid);
+static void bamf_window_finalized                                    (gpointer user_data,
+                                                                      GObject * where_the_object_was);
+static void publish_registry                                         (IndicatorAppmenu * iapp);
+static void schedule_publish_registry                                (IndicatorAppmenu * iapp);
 static WindowMenu * ensure_menus                                     (IndicatorAppmenu * iapp,
 	                                                                  BamfWindow * window);
+static void track_menus                                              (IndicatorAppmenu * iapp,
+                                                                      guint xid,
+                                                                      WindowMenu * menus);
+static GVariant * register_window                                    (IndicatorAppmenu * iapp,
+                                                                      guint windowid,
+                                                                      const gchar * objectpath,
+                                                                      const gchar * sender);
 static GVariant * unregister_window                                  (IndicatorAppmenu * iapp,
                                                                       guint windowid);
 static void connect_to_menu_signals                                  (IndicatorAppmenu * iapp,
 	                                                                  WindowMenu * menus);
+static void disconnect_from_menu_signals                             (IndicatorAppmenu * iapp,
+	                                                                  WindowMenu * menus);
 
 /* Unique error codes for debug interface */
 enum {
@@ -227,6 +364,18 @@ static GDBusInterfaceVTable interface_table = {
        set_property:   NULL  /* No properties */
 };
 
+/* Indicator object signals we forward to, resolved once */
+enum {
+	IO_ENTRY_ADDED,
+	IO_ENTRY_REMOVED,
+	IO_ENTRY_MOVED,
+	IO_MENU_SHOW,
+	IO_ACCESSIBLE_DESC_UPDATE,
+	IO_LAST_SIGNAL
+};
+
+static guint io_signals[IO_LAST_SIGNAL] = { 0 };
+
 G_DEFINE_TYPE (IndicatorAppmenu, indicator_appmenu, INDICATOR_OBJECT_TYPE);
 
 /* One time init */
@@ -249,6 +398,14 @@ indicator_appmenu_class_init (IndicatorAppmenuClass *klass)
 	ioclass->entry_activate = entry_activate;
 	ioclass->entry_activate_window = entry_activate_window;
 
+	/* Look up the signals we pass entries up through so that
+	   forwarding them doesn't need a name lookup each time */
+	io_signals[IO_ENTRY_ADDED] = g_signal_lookup(INDICATOR_OBJECT_SIGNAL_ENTRY_ADDED, INDICATOR_OBJECT_TYPE);
+	io_signals[IO_ENTRY_REMOVED] = g_signal_lookup(INDICATOR_OBJECT_SIGNAL_ENTRY_REMOVED, INDICATOR_OBJECT_TYPE);
+	io_signals[IO_ENTRY_MOVED] = g_signal_lookup(INDICATOR_OBJECT_SIGNAL_ENTRY_MOVED, INDICATOR_OBJECT_TYPE);
+	io_signals[IO_MENU_SHOW] = g_signal_lookup(INDICATOR_OBJECT_SIGNAL_MENU_SHOW, INDICATOR_OBJECT_TYPE);
+	io_signals[IO_ACCESSIBLE_DESC_UPDATE] = g_signal_lookup(INDICATOR_OBJECT_SIGNAL_ACCESSIBLE_DESC_UPDATE, INDICATOR_OBJECT_TYPE);
+
 	/* Setting up the DBus interfaces */
 	if (node_info == NULL) {
 		GError * error = NULL;
@@ -275,12 +432,29 @@ indicator_appmenu_class_init (IndicatorAppmenuClass *klass)
 static void
 indicator_appmenu_init (IndicatorAppmenu *self)
 {
-	self->apps = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, g_object_unref);
+	self->windows = xid_table_new(g_object_unref);
+	self->transient_owners = xid_table_new(NULL);
+	self->bamf_windows = xid_table_new(NULL);
 	self->mode = MODE_STANDARD;
 	self->active_stubs = STUBS_UNKNOWN;
+	self->startup_begin = g_get_monotonic_time();
+	self->preloaded = g_array_new(FALSE, FALSE, sizeof(guint32));
+	self->focus_times = g_hash_table_new(g_direct_hash, g_direct_equal);
+	self->hibernated = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, hibernated_free);
+
+	/* Don't abort on a missing schema, the defaults work fine */
+	GSettingsSchemaSource * source = g_settings_schema_source_get_default();
+	GSettingsSchema * schema = NULL;
+	if (source != NULL) {
+		schema = g_settings_schema_source_lookup(source, SETTINGS_SCHEMA, TRUE);
+	}
+	if (schema != NULL) {
+		self->settings = g_settings_new(SETTINGS_SCHEMA);
+		g_settings_schema_unref(schema);
+	}
 
-	/* Setup the cache of windows with possible desktop entries */
-	self->desktop_windows = g_hash_table_new(g_direct_hash, g_direct_equal);
+	g_mutex_init(&self->registry_lock);
+	publish_registry(self);
 
 	g_idle_add((GSourceFunc) indicator_appmenu_delayed_init, self);
 }
@@ -298,6 +472,24 @@ indicator_appmenu_delayed_init (IndicatorAppmenu *self)
 	if (self->mode != MODE_STANDARD)
 		self->active_stubs = STUBS_HIDE;
 
+	/* Request a name so others can find us.  This comes first as
+	   clients starting with the session are waiting on it, and
+	   registering doesn't need anything below.  The registrar stays
+	   in the panel rather than its own service: GetMenuForWindow(0)
+	   means the focused window and GMenuModel windows are only known
+	   through BAMF here, so a daemon would need all of that state. */
+	self->owner_id = g_bus_own_name (G_BUS_TYPE_SESSION,
+	                                 DBUS_NAME,
+	                                 G_BUS_NAME_OWNER_FLAGS_NONE,
+	                                 on_bus_acquired,
+	                                 NULL,
+	                                 on_name_lost,
+	                                 self,
+	                                 NULL);
+
+	g_debug("Startup: name requested %" G_GINT64_FORMAT " us after load",
+	        g_get_monotonic_time() - self->startup_begin);
+
 	if (self->active_stubs != STUBS_HIDE)
 		build_window_menus(self);
 
@@ -313,43 +505,53 @@ indicator_appmenu_delayed_init (IndicatorAppmenu *self)
 		/* Desktop window tracking */
 		g_signal_connect(G_OBJECT(self->matcher), "view-opened", G_CALLBACK(new_window), self);
 		g_signal_connect(G_OBJECT(self->matcher), "view-closed", G_CALLBACK(old_window), self);
+		g_signal_connect(G_OBJECT(self->matcher), "view-opened", G_CALLBACK(preload_window), self);
+
+		find_relevant_windows(self);
 	}
 
-	find_relevant_windows(self);
+	/* All menus are on screen in that mode, there's nothing to let
+	   sleep */
+	if (self->mode != MODE_UNITY_ALL_MENUS) {
+		self->hibernate_timer = g_timeout_add_seconds(HIBERNATE_CHECK_INTERVAL, hibernate_check, self);
 
-	/* Request a name so others can find us */
-	self->owner_id = g_bus_own_name (G_BUS_TYPE_SESSION,
-	                                 DBUS_NAME,
-	                                 G_BUS_NAME_OWNER_FLAGS_NONE,
-	                                 on_bus_acquired,
-	                                 NULL,
-	                                 on_name_lost,
-	                                 self,
-	                                 NULL);
+#if GLIB_CHECK_VERSION(2,64,0)
+		self->memory_monitor = g_memory_monitor_dup_default();
+		if (self->memory_monitor != NULL) {
+			g_signal_connect(self->memory_monitor, "low-memory-warning", G_CALLBACK(low_memory_warning), self);
+		}
+#endif
+	}
 
 	return G_SOURCE_REMOVE;
 }
 
-static void
-on_bus_acquired (GDBusConnection * connection, const gchar * name,
-                 gpointer user_data)
+/* Runs the worker's main loop */
+static gpointer
+worker_thread (gpointer user_data)
 {
 	IndicatorAppmenu * iapp = INDICATOR_APPMENU(user_data);
-	GError * error = NULL;
 
-	if (connection == NULL) {
-		g_critical ("Unable to get session bus.");
-		exit (0);
-	}
+	g_main_context_push_thread_default(iapp->worker_context);
+	g_main_loop_run(iapp->worker_loop);
+	g_main_context_pop_thread_default(iapp->worker_context);
 
-	iapp->bus = connection;
+	return NULL;
+}
 
-	/* Now register our object on our new connection */
-	iapp->dbus_registration = g_dbus_connection_register_object(connection,
+/* Register the object from the worker so that GDBus dispatches its
+   method calls there */
+static gboolean
+worker_register_object (gpointer user_data)
+{
+	IndicatorAppmenu * iapp = INDICATOR_APPMENU(user_data);
+	GError * error = NULL;
+
+	iapp->dbus_registration = g_dbus_connection_register_object(iapp->bus,
 	                                                            REG_OBJECT,
 	                                                            interface_info,
 	                                                            &interface_table,
-	                                                            user_data,
+	                                                            iapp,
 	                                                            NULL,
 	                                                            &error);
 
@@ -357,6 +559,31 @@ on_bus_acquired (GDBusConnection * connection, const gchar * name,
 		g_critical("Unable to register the object to DBus: %s", error->message);
 		g_error_free(error);
 	}
+
+	return G_SOURCE_REMOVE;
+}
+
+static void
+on_bus_acquired (GDBusConnection * connection, const gchar * name,
+                 gpointer user_data)
+{
+	IndicatorAppmenu * iapp = INDICATOR_APPMENU(user_data);
+
+	if (connection == NULL) {
+		g_critical ("Unable to get session bus.");
+		exit (0);
+	}
+
+	iapp->bus = connection;
+
+	if (iapp->worker == NULL) {
+		iapp->worker_context = g_main_context_new();
+		iapp->worker_loop = g_main_loop_new(iapp->worker_context, FALSE);
+		iapp->worker = g_thread_new("appmenu-registrar", worker_thread, iapp);
+	}
+
+	/* Now register our object on our new connection */
+	g_main_context_invoke(iapp->worker_context, worker_register_object, iapp);
 }
 
 static void
@@ -383,13 +610,76 @@ indicator_appmenu_dispose (GObject *object)
 {
 	IndicatorAppmenu * iapp = INDICATOR_APPMENU(object);
 
+	/* Registrations already queued for the main loop get turned away */
+	iapp->disposed = TRUE;
+
+	/* Take the object off the bus so no new calls come in, then stop
+	   the worker so nothing is dispatching while we tear down */
 	if (iapp->dbus_registration != 0) {
 		g_dbus_connection_unregister_object(iapp->bus, iapp->dbus_registration);
 		/* Don't care if it fails, there's nothing we can do */
 		iapp->dbus_registration = 0;
 	}
 
+	if (iapp->worker != NULL) {
+		g_main_loop_quit(iapp->worker_loop);
+		g_thread_join(iapp->worker);
+		iapp->worker = NULL;
+
+		g_main_loop_unref(iapp->worker_loop);
+		iapp->worker_loop = NULL;
+		g_main_context_unref(iapp->worker_context);
+		iapp->worker_context = NULL;
+	}
+
+	/* The worker may have gotten to registering while we did that */
+	if (iapp->dbus_registration != 0) {
+		g_dbus_connection_unregister_object(iapp->bus, iapp->dbus_registration);
+		iapp->dbus_registration = 0;
+	}
+
 	g_clear_object(&iapp->bus);
+	g_clear_object(&iapp->settings);
+
+	if (iapp->focus_timer != 0) {
+		g_source_remove(iapp->focus_timer);
+		iapp->focus_timer = 0;
+	}
+
+	if (iapp->focus_pending != NULL) {
+		g_object_remove_weak_pointer(G_OBJECT(iapp->focus_pending), (gpointer *)&iapp->focus_pending);
+		iapp->focus_pending = NULL;
+	}
+	focus_release_menus(iapp);
+
+	if (iapp->startup_idle != 0) {
+		g_source_remove(iapp->startup_idle);
+		iapp->startup_idle = 0;
+	}
+
+	g_list_free_full(iapp->startup_windows, g_object_unref);
+	iapp->startup_windows = NULL;
+
+	if (iapp->preload_idle != 0) {
+		g_source_remove(iapp->preload_idle);
+		iapp->preload_idle = 0;
+	}
+
+	while (!g_queue_is_empty(&iapp->preload_queue)) {
+		g_object_unref(g_queue_pop_head(&iapp->preload_queue));
+	}
+
+	if (iapp->hibernate_timer != 0) {
+		g_source_remove(iapp->hibernate_timer);
+		iapp->hibernate_timer = 0;
+	}
+
+#if GLIB_CHECK_VERSION(2,64,0)
+	if (iapp->memory_monitor != NULL) {
+		g_signal_handlers_disconnect_by_data(iapp->memory_monitor, iapp);
+		g_clear_object(&iapp->memory_monitor);
+	}
+#endif
 
 	if (iapp->owner_id != 0) {
 		g_bus_unown_name(iapp->owner_id);
@@ -403,8 +693,40 @@ indicator_appmenu_dispose (GObject *object)
 	/* No specific ref */
 	switch_default_app(iapp, NULL, NULL);
 
-	g_clear_pointer(&iapp->apps, g_hash_table_destroy);
-	g_clear_pointer(&iapp->desktop_windows, g_hash_table_destroy);
+	if (iapp->windows != NULL) {
+		XidTableIter iter;
+		XidTableEntry * entry;
+
+		/* Menus going away tell us about their entries, which
+		   we don't want to hear about anymore */
+		xid_table_iter_init(&iter, iapp->windows);
+		while (xid_table_iter_next(&iter, &entry)) {
+			if (entry->data != NULL) {
+				g_signal_handlers_disconnect_by_data(entry->data, iapp);
+			}
+		}
+
+		g_clear_pointer(&iapp->windows, xid_table_free);
+	}
+	g_clear_pointer(&iapp->transient_owners, xid_table_free);
+
+	/* Only once nothing is left to schedule it */
+	if (iapp->registry_idle != 0) {
+		g_source_remove(iapp->registry_idle);
+		iapp->registry_idle = 0;
+	}
+
+	if (iapp->bamf_windows != NULL) {
+		XidTableIter iter;
+		XidTableEntry * entry;
+
+		xid_table_iter_init(&iter, iapp->bamf_windows);
+		while (xid_table_iter_next(&iter, &entry)) {
+			g_object_weak_unref(G_OBJECT(entry->data), bamf_window_finalized, iapp);
+		}
+
+		g_clear_pointer(&iapp->bamf_windows, xid_table_free);
+	}
 
 	if (iapp->desktop_menu != NULL) {
 		/* Wait, nothing here?  Yup.  We're not referencing the
@@ -437,6 +759,13 @@ indicator_appmenu_finalize (GObject *object)
 
 	g_signal_handlers_disconnect_by_data(iapp->matcher, iapp);
 
+	g_clear_pointer(&iapp->registry, registry_snapshot_unref);
+	g_mutex_clear(&iapp->registry_lock);
+
+	g_array_free(iapp->preloaded, TRUE);
+	g_hash_table_destroy(iapp->focus_times);
+	g_hash_table_destroy(iapp->hibernated);
+
 	G_OBJECT_CLASS (indicator_appmenu_parent_class)->finalize (object);
 	return;
 }
@@ -509,7 +838,7 @@ static void
 build_window_menus (IndicatorAppmenu * iapp)
 {
 	IndicatorObjectEntry entries[1] = {{0}};
-	GtkAccelGroup * agroup = gtk_accel_group_new();
+	GtkAccelGroup * agroup = window_menu_get_accel_group(NULL);
 	GtkMenuItem * mi = NULL;
 	GtkStockItem stockitem;
 
@@ -545,6 +874,45 @@ G_GNUC_END_IGNORE_DEPRECATIONS
 
 	/* Copy the entries on the stack into the array */
 	g_array_insert_vals(iapp->window_menus, 0, entries, 1);
+
+	/* The close item's label holds on to the group */
+	g_object_unref(agroup);
+}
+
+/* How a backend should fetch menus, read for each new window so
+   changes apply to the next one that registers */
+static WindowMenuLayout
+menu_layout (IndicatorAppmenu * iapp, const gchar * key, WindowMenuLayout fallback)
+{
+	if (iapp->settings == NULL) {
+		return fallback;
+	}
+
+	return (WindowMenuLayout)g_settings_get_enum(iapp->settings, key);
+}
+
+/* The menus we have for a window, if any */
+static WindowMenu *
+lookup_menus (IndicatorAppmenu * iapp, guint32 xid)
+{
+	XidTableEntry * entry = xid_table_lookup(iapp->windows, xid);
+
+	if (entry == NULL) {
+		return NULL;
+	}
+
+	return (WindowMenu *)entry->data;
+}
+
+/* Drop a window's entry once there's nothing left in it */
+static void
+forget_window (IndicatorAppmenu * iapp, guint32 xid)
+{
+	XidTableEntry * entry = xid_table_lookup(iapp->windows, xid);
+
+	if (entry != NULL && entry->data == NULL && entry->flags == 0) {
+		xid_table_remove(iapp->windows, xid);
+	}
 }
 
 /* Determine which windows should be used as the desktop
@@ -552,21 +920,18 @@ G_GNUC_END_IGNORE_DEPRECATIONS
 static void
 determine_new_desktop (IndicatorAppmenu * iapp)
 {
-	GList * keys = g_hash_table_get_keys(iapp->desktop_windows);
-	GList * key;
-
-	for (key = keys; key != NULL; key = g_list_next(key)) {
-		guint xid = GPOINTER_TO_UINT(key->data);
-		gpointer pwm = g_hash_table_lookup(iapp->apps, GUINT_TO_POINTER(xid));
-		if (pwm != NULL) {
-			g_debug("Setting Desktop Menus to: %X", xid);
-			iapp->desktop_menu = WINDOW_MENU(pwm);
+	XidTableIter iter;
+	XidTableEntry * entry;
+
+	xid_table_iter_init(&iter, iapp->windows);
+	while (xid_table_iter_next(&iter, &entry)) {
+		if ((entry->flags & XID_TABLE_FLAG_DESKTOP) && entry->data != NULL) {
+			g_debug("Setting Desktop Menus to: %X", entry->xid);
+			iapp->desktop_menu = WINDOW_MENU(entry->data);
 			break;
 		}
 	}
 
-	g_list_free(keys);
-
 	return;
 }
 
@@ -576,14 +941,107 @@ static void
 find_relevant_windows (IndicatorAppmenu * iapp)
 {
 	GList * windows = bamf_matcher_get_windows(iapp->matcher);
-	GList * lwindow;
 
-	for (lwindow = windows; lwindow != NULL; lwindow = g_list_next(lwindow)) {
-		BamfView * view = BAMF_VIEW(lwindow->data);
-		new_window(iapp->matcher, view, iapp);
+	/* Ours to keep until the scan gets to them */
+	g_list_foreach(windows, (GFunc)g_object_ref, NULL);
+	iapp->startup_windows = windows;
+
+	iapp->startup_idle = g_idle_add(find_relevant_windows_chunk, iapp);
+
+	return;
+}
+
+/* Handle windows from the startup list until we've used up our
+   time slice, then let the main loop breathe */
+static gboolean
+find_relevant_windows_chunk (gpointer user_data)
+{
+	IndicatorAppmenu * iapp = INDICATOR_APPMENU(user_data);
+	gint64 deadline = g_get_monotonic_time() + STARTUP_CHUNK_USEC;
+
+	iapp->startup_chunks++;
+
+	/* Always at least one so we're sure to finish */
+	do {
+		GList * head = iapp->startup_windows;
+		if (head == NULL) {
+			break;
+		}
+
+		BamfView * view = BAMF_VIEW(head->data);
+		iapp->startup_windows = g_list_delete_link(head, head);
+
+		if (!bamf_view_is_closed(view)) {
+			new_window(iapp->matcher, view, iapp);
+		}
+		g_object_unref(view);
+
+		iapp->startup_count++;
+	} while (g_get_monotonic_time() < deadline);
+
+	if (iapp->startup_windows != NULL) {
+		return G_SOURCE_CONTINUE;
+	}
+
+	g_debug("Startup: %u windows found in %u chunks, done %" G_GINT64_FORMAT " us after load",
+	        iapp->startup_count, iapp->startup_chunks,
+	        g_get_monotonic_time() - iapp->startup_begin);
+
+	iapp->startup_idle = 0;
+	return G_SOURCE_REMOVE;
+}
+
+/* BAMF dropped a window without telling us it closed */
+static void
+bamf_window_finalized (gpointer user_data, GObject * where_the_object_was)
+{
+	IndicatorAppmenu * iapp = INDICATOR_APPMENU(user_data);
+	XidTableIter iter;
+	XidTableEntry * entry;
+
+	xid_table_iter_init(&iter, iapp->bamf_windows);
+	while (xid_table_iter_next(&iter, &entry)) {
+		if (entry->data == (gpointer)where_the_object_was) {
+			xid_table_remove(iapp->bamf_windows, entry->xid);
+			break;
+		}
+	}
+
+	return;
+}
+
+/* Keep track of a window so we can find it by XID */
+static void
+index_bamf_window (IndicatorAppmenu * iapp, guint32 xid, BamfWindow * window)
+{
+	XidTableEntry * entry = xid_table_insert(iapp->bamf_windows, xid);
+	g_return_if_fail(entry != NULL);
+
+	if (entry->data == window) {
+		return;
+	}
+
+	if (entry->data != NULL) {
+		g_object_weak_unref(G_OBJECT(entry->data), bamf_window_finalized, iapp);
+	}
+
+	entry->data = window;
+	g_object_weak_ref(G_OBJECT(window), bamf_window_finalized, iapp);
+
+	return;
+}
+
+static void
+unindex_bamf_window (IndicatorAppmenu * iapp, guint32 xid)
+{
+	XidTableEntry * entry = xid_table_lookup(iapp->bamf_windows, xid);
+
+	if (entry == NULL) {
+		return;
 	}
 
-	g_list_free(windows);
+	g_object_weak_unref(G_OBJECT(entry->data), bamf_window_finalized, iapp);
+	xid_table_remove(iapp->bamf_windows, xid);
 
 	return;
 }
@@ -601,6 +1059,10 @@ new_window (BamfMatcher * matcher, BamfView * view, gpointer user_data)
 	IndicatorAppmenu * iapp = INDICATOR_APPMENU(user_data);
 	guint32 xid = bamf_window_get_xid(window);
 
+	if (xid != 0) {
+		index_bamf_window(iapp, xid, window);
+	}
+
 	if (iapp->mode == MODE_UNITY_ALL_MENUS) {
 		ensure_menus(iapp, window);
 		return;
@@ -610,13 +1072,17 @@ new_window (BamfMatcher * matcher, BamfView * view, gpointer user_data)
 		return;
 	}
 
-	g_hash_table_insert(iapp->desktop_windows, GUINT_TO_POINTER(xid), GINT_TO_POINTER(TRUE));
+	/* The table has no slot for a window without an XID */
+	XidTableEntry * entry = xid_table_insert(iapp->windows, xid);
+	if (entry == NULL) {
+		return;
+	}
+	entry->flags |= XID_TABLE_FLAG_DESKTOP;
 
 	g_debug("New Desktop Window: %X", xid);
 
-	gpointer pwm = g_hash_table_lookup(iapp->apps, GUINT_TO_POINTER(xid));
-	if (pwm != NULL) {
-		WindowMenu * wm = WINDOW_MENU(pwm);
+	WindowMenu * wm = lookup_menus(iapp, xid);
+	if (wm != NULL) {
 		iapp->desktop_menu = wm;
 		g_debug("Setting Desktop Menus to: %X", xid);
 		if (iapp->active_window == NULL && iapp->default_app == NULL) {
@@ -637,73 +1103,353 @@ old_window (BamfMatcher * matcher, BamfView * view, gpointer user_data)
 	BamfWindow * window = BAMF_WINDOW(view);
 	guint32 xid = bamf_window_get_xid(window);
 
+	unindex_bamf_window(iapp, xid);
+	forget_transients(iapp, xid);
 	unregister_window(iapp, xid);
 
 	return;
 }
 
-/* List of desktop files that shouldn't have menu stubs. */
-const static gchar * stubs_blacklist[] = {
-	/* Firefox */
-	"/firefox.desktop",
-	/* Thunderbird */
-	"/thunderbird.desktop",
-	/* Open Office */
-	"/openoffice.org-base.desktop",
-	"/openoffice.org-impress.desktop",
-	"/openoffice.org-calc.desktop",
-	"/openoffice.org-math.desktop",
-	"/openoffice.org-draw.desktop",
-	"/openoffice.org-writer.desktop",
-	/* Blender */
-	"/blender-fullscreen.desktop",
-	"/blender-windowed.desktop",
-	/* Eclipse */
-	"/eclipse.desktop",
+static void
+hibernated_free (gpointer data)
+{
+	HibernatedWindow * hw = (HibernatedWindow *)data;
 
-	NULL
-};
+	g_free(hw->address);
+	g_free(hw->path);
+	g_strfreev(hw->labels);
+	g_free(hw);
 
-/* Check with BAMF, and then check the blacklist of desktop files
-   to see if any are there.  Otherwise, show the stubs. */
-gboolean
-show_menu_stubs (BamfApplication * app)
-{
-	if (bamf_application_get_show_menu_stubs(app) == FALSE) {
-		return FALSE;
-	}
+	return;
+}
 
-	const gchar * desktop_file = bamf_application_get_desktop_file(app);
-	if (desktop_file == NULL || desktop_file[0] == '\0') {
-		return TRUE;
-	}
+/* Remember that a window's menus are in use */
+static void
+note_focus (IndicatorAppmenu * iapp, guint32 xid)
+{
+	guint now = g_get_monotonic_time() / G_USEC_PER_SEC;
 
-	int i;
-	for (i = 0; stubs_blacklist[i] != NULL; i++) {
-		if (g_str_has_suffix(desktop_file, stubs_blacklist[i]) == 0) {
-			return FALSE;
-		}
-	}
+	g_hash_table_insert(iapp->focus_times, GUINT_TO_POINTER(xid), GUINT_TO_POINTER(now));
 
-	return TRUE;
+	return;
 }
 
-/* Get the current set of entries */
-static GList *
-get_entries (IndicatorObject * io)
+/* Drop the menus of a window, keeping only what the registrar needs
+   and what they looked like */
+static void
+hibernate_window (IndicatorAppmenu * iapp, guint32 xid)
 {
-	g_return_val_if_fail(IS_INDICATOR_APPMENU(io), NULL);
-	IndicatorAppmenu * iapp = INDICATOR_APPMENU(io);
-	GHashTableIter iter;
-	gpointer value;
-	GList* entries = NULL;
+	XidTableEntry * entry = xid_table_lookup(iapp->windows, xid);
+	g_return_if_fail(entry != NULL && entry->data != NULL);
 
-	if (iapp->mode == MODE_UNITY_ALL_MENUS) {
-		g_hash_table_iter_init(&iter, iapp->apps);
-		while (g_hash_table_iter_next(&iter, NULL, &value)) {
-			GList *app_entries = window_menu_get_entries(WINDOW_MENU (value));
-			entries = g_list_concat(app_entries, entries);
-		}
+	WindowMenu * wm = WINDOW_MENU(entry->data);
+	HibernatedWindow * hw = g_new0(HibernatedWindow, 1);
+	GList * entries = window_menu_get_entries(wm);
+	GList * l;
+	guint i = 0;
+
+	hw->backend = entry->backend;
+	if (IS_WINDOW_MENU_DBUSMENU(wm)) {
+		hw->address = window_menu_dbusmenu_get_address(WINDOW_MENU_DBUSMENU(wm));
+		hw->path = window_menu_dbusmenu_get_path(WINDOW_MENU_DBUSMENU(wm));
+	}
+
+	hw->labels = g_new0(gchar *, g_list_length(entries) + 1);
+	for (l = entries; l != NULL; l = l->next) {
+		IndicatorObjectEntry * ioentry = (IndicatorObjectEntry *)l->data;
+		hw->labels[i++] = g_strdup(ioentry->label != NULL ? gtk_label_get_label(ioentry->label) : "");
+	}
+	iapp->hibernate_entries += i;
+	g_list_free(entries);
+
+	g_signal_handlers_disconnect_by_data(wm, iapp);
+	entry->data = NULL;
+	g_hash_table_insert(iapp->hibernated, GUINT_TO_POINTER(xid), hw);
+	forget_window(iapp, xid);
+	g_object_unref(wm);
+
+	iapp->hibernate_total++;
+
+	return;
+}
+
+/* Drop the menus of every window that hasn't had focus since
+   @cutoff, other than the ones that could be on screen */
+static void
+hibernate_windows (IndicatorAppmenu * iapp, guint cutoff)
+{
+	GArray * sleepy = g_array_new(FALSE, FALSE, sizeof(guint32));
+	XidTableIter iter;
+	XidTableEntry * entry;
+	guint32 pending = 0;
+	guint i;
+
+	/* The window about to be focused is going to want its menus */
+	if (iapp->focus_pending != NULL) {
+		pending = bamf_window_get_xid(iapp->focus_pending);
+	}
+
+	xid_table_iter_init(&iter, iapp->windows);
+	while (xid_table_iter_next(&iter, &entry)) {
+		if (entry->data == NULL || (entry->flags & XID_TABLE_FLAG_DESKTOP)) {
+			continue;
+		}
+
+		if (entry->data == iapp->default_app || entry->data == iapp->desktop_menu || entry->xid == pending) {
+			continue;
+		}
+
+		guint focused = GPOINTER_TO_UINT(g_hash_table_lookup(iapp->focus_times, GUINT_TO_POINTER(entry->xid)));
+		if (focused > cutoff) {
+			continue;
+		}
+
+		g_array_append_val(sleepy, entry->xid);
+	}
+
+	/* Not while iterating, dropping can shrink the table */
+	for (i = 0; i < sleepy->len; i++) {
+		hibernate_window(iapp, g_array_index(sleepy, guint32, i));
+	}
+
+	if (sleepy->len > 0) {
+		publish_registry(iapp);
+		g_debug("Hibernated %u windows: %u asleep, %u hibernated and %u woken in total, %u menu entries released",
+		        sleepy->len, g_hash_table_size(iapp->hibernated),
+		        iapp->hibernate_total, iapp->hibernate_woken, iapp->hibernate_entries);
+	}
+
+	g_array_free(sleepy, TRUE);
+	return;
+}
+
+/* How long a window can go without focus, 0 when we never drop
+   menus at all */
+static guint
+hibernate_after (IndicatorAppmenu * iapp)
+{
+	if (iapp->settings == NULL) {
+		return HIBERNATE_AFTER_DEFAULT;
+	}
+
+	return g_settings_get_uint(iapp->settings, SETTINGS_HIBERNATE_AFTER);
+}
+
+/* Look for windows that have gone unused for long enough */
+static gboolean
+hibernate_check (gpointer user_data)
+{
+	IndicatorAppmenu * iapp = INDICATOR_APPMENU(user_data);
+	guint minutes = hibernate_after(iapp);
+
+	guint now = g_get_monotonic_time() / G_USEC_PER_SEC;
+	if (minutes != 0 && now > minutes * 60) {
+		hibernate_windows(iapp, now - minutes * 60);
+	}
+
+	return G_SOURCE_CONTINUE;
+}
+
+#if GLIB_CHECK_VERSION(2,64,0)
+/* Memory is short, everything that isn't showing can go */
+static void
+low_memory_warning (GMemoryMonitor * monitor, GMemoryMonitorWarningLevel level, gpointer user_data)
+{
+	IndicatorAppmenu * iapp = INDICATOR_APPMENU(user_data);
+
+	if (hibernate_after(iapp) == 0) {
+		return;
+	}
+
+	g_debug("Low memory warning, level %d", level);
+	hibernate_windows(iapp, G_MAXUINT);
+
+	return;
+}
+#endif
+
+/* Build the menus of a hibernated window again.  GMenuModel ones
+   are found again from the window itself. */
+static WindowMenu *
+wake_menus (IndicatorAppmenu * iapp, guint32 xid)
+{
+	HibernatedWindow * hw = g_hash_table_lookup(iapp->hibernated, GUINT_TO_POINTER(xid));
+
+	if (hw == NULL || hw->backend != REGISTRY_BACKEND_DBUSMENU) {
+		return NULL;
+	}
+
+	WindowMenu * wm = WINDOW_MENU(window_menu_dbusmenu_new(xid, hw->address, hw->path, menu_layout(iapp, SETTINGS_DBUSMENU_LAYOUT, WINDOW_MENU_LAYOUT_FULL)));
+	g_return_val_if_fail(wm != NULL, NULL);
+
+	track_menus(iapp, xid, wm);
+
+	return wm;
+}
+
+/* Drop the preloaded windows that have been focused or whose menus
+   have gone, leaving only the ones still waiting for focus */
+static void
+preload_claim (IndicatorAppmenu * iapp, WindowMenu * menus)
+{
+	guint i = 0;
+
+	while (i < iapp->preloaded->len) {
+		WindowMenu * wm = lookup_menus(iapp, g_array_index(iapp->preloaded, guint32, i));
+
+		if (wm == NULL || wm == menus) {
+			g_array_remove_index_fast(iapp->preloaded, i);
+		} else {
+			i++;
+		}
+	}
+
+	return;
+}
+
+/* Build the menus for one queued window, the rest wait for the next
+   time the main loop is idle */
+static gboolean
+preload_idle_cb (gpointer user_data)
+{
+	IndicatorAppmenu * iapp = INDICATOR_APPMENU(user_data);
+	BamfWindow * window = g_queue_pop_head(&iapp->preload_queue);
+
+	preload_claim(iapp, NULL);
+
+	if (window != NULL && iapp->preloaded->len < PRELOAD_MAX && !bamf_view_is_closed(BAMF_VIEW(window))) {
+		guint32 xid = bamf_window_get_xid(window);
+
+		/* Only count menus that are the window's own, not ones
+		   it found on a window it's a transient of */
+		if (xid != 0 && lookup_menus(iapp, xid) == NULL) {
+			WindowMenu * menus = ensure_menus(iapp, window);
+
+			if (menus != NULL && menus == lookup_menus(iapp, xid)) {
+				g_debug("Preloaded menus for XID %d", xid);
+				g_array_append_val(iapp->preloaded, xid);
+			}
+		}
+	}
+
+	g_clear_object(&window);
+
+	if (!g_queue_is_empty(&iapp->preload_queue)) {
+		return G_SOURCE_CONTINUE;
+	}
+
+	iapp->preload_idle = 0;
+	return G_SOURCE_REMOVE;
+}
+
+/* A window just opened, if asked to build its menus now so they're
+   ready when it gets focus instead of after */
+static void
+preload_window (BamfMatcher * matcher, BamfView * view, gpointer user_data)
+{
+	IndicatorAppmenu * iapp = INDICATOR_APPMENU(user_data);
+
+	if (iapp->mode != MODE_STANDARD || iapp->settings == NULL) {
+		return;
+	}
+
+	if (!g_settings_get_boolean(iapp->settings, SETTINGS_PRELOAD_MENUS)) {
+		return;
+	}
+
+	if (!BAMF_IS_WINDOW(view) || bamf_window_get_window_type(BAMF_WINDOW(view)) != BAMF_WINDOW_NORMAL) {
+		return;
+	}
+
+	/* A burst of windows only gets its newest ones looked at */
+	if (g_queue_get_length(&iapp->preload_queue) >= PRELOAD_QUEUE_MAX) {
+		g_object_unref(g_queue_pop_head(&iapp->preload_queue));
+	}
+
+	g_queue_push_tail(&iapp->preload_queue, g_object_ref(view));
+
+	if (iapp->preload_idle == 0) {
+		iapp->preload_idle = g_idle_add_full(G_PRIORITY_LOW, preload_idle_cb, iapp, NULL);
+	}
+
+	return;
+}
+
+/* List of desktop files that shouldn't have menu stubs. */
+const static gchar * stubs_blacklist[] = {
+	/* Firefox */
+	"/firefox.desktop",
+	/* Thunderbird */
+	"/thunderbird.desktop",
+	/* Open Office */
+	"/openoffice.org-base.desktop",
+	"/openoffice.org-impress.desktop",
+	"/openoffice.org-calc.desktop",
+	"/openoffice.org-math.desktop",
+	"/openoffice.org-draw.desktop",
+	"/openoffice.org-writer.desktop",
+	/* Blender */
+	"/blender-fullscreen.desktop",
+	"/blender-windowed.desktop",
+	/* Eclipse */
+	"/eclipse.desktop",
+
+	NULL
+};
+
+/* Check with BAMF, and then check the blacklist of desktop files
+   to see if any are there.  Otherwise, show the stubs. */
+gboolean
+show_menu_stubs (BamfApplication * app)
+{
+	if (bamf_application_get_show_menu_stubs(app) == FALSE) {
+		return FALSE;
+	}
+
+	const gchar * desktop_file = bamf_application_get_desktop_file(app);
+	if (desktop_file == NULL || desktop_file[0] == '\0') {
+		return TRUE;
+	}
+
+	/* Same cache as the application names */
+	DesktopCacheStubs cached = desktop_cache_get_stubs(desktop_file);
+	if (cached != DESKTOP_CACHE_STUBS_UNKNOWN) {
+		return cached == DESKTOP_CACHE_STUBS_SHOW;
+	}
+
+	gboolean show = TRUE;
+	int i;
+	for (i = 0; stubs_blacklist[i] != NULL; i++) {
+		if (g_str_has_suffix(desktop_file, stubs_blacklist[i]) == 0) {
+			show = FALSE;
+			break;
+		}
+	}
+
+	desktop_cache_set_stubs(desktop_file, show ? DESKTOP_CACHE_STUBS_SHOW : DESKTOP_CACHE_STUBS_HIDE);
+
+	return show;
+}
+
+/* Get the current set of entries */
+static GList *
+get_entries (IndicatorObject * io)
+{
+	g_return_val_if_fail(IS_INDICATOR_APPMENU(io), NULL);
+	IndicatorAppmenu * iapp = INDICATOR_APPMENU(io);
+	XidTableIter iter;
+	XidTableEntry * value;
+	GList* entries = NULL;
+
+	if (iapp->mode == MODE_UNITY_ALL_MENUS) {
+		xid_table_iter_init(&iter, iapp->windows);
+		while (xid_table_iter_next(&iter, &value)) {
+			if (value->data == NULL) {
+				continue;
+			}
+			GList *app_entries = window_menu_get_entries(WINDOW_MENU (value->data));
+			entries = g_list_concat(app_entries, entries);
+		}
 
 		return entries;
 	}
@@ -762,12 +1508,15 @@ get_location (IndicatorObject * io, IndicatorObjectEntry * entry)
 	IndicatorAppmenu * iapp = INDICATOR_APPMENU(io);
 
 	if (iapp->mode == MODE_UNITY_ALL_MENUS) {
-		GHashTableIter iter;
-		gpointer value;
+		XidTableIter iter;
+		XidTableEntry * value;
 
-		g_hash_table_iter_init(&iter, iapp->apps);
-		while (g_hash_table_iter_next(&iter, NULL, &value)) {
-			count = window_menu_get_location(WINDOW_MENU (value), entry);
+		xid_table_iter_init(&iter, iapp->windows);
+		while (xid_table_iter_next(&iter, &value)) {
+			if (value->data == NULL) {
+				continue;
+			}
+			count = window_menu_get_location(WINDOW_MENU (value->data), entry);
 
 			if (count != G_MAXUINT)
 				return count;
@@ -807,15 +1556,25 @@ entry_activate (IndicatorObject * io, IndicatorObjectEntry * entry, guint timest
 	return entry_activate_window(io, entry, 0, timestamp);
 }
 
-/* Find the BAMF Window that is associated with that XID.  Unfortunately
-   this requires a bit of searching, don't do it too often */
+/* Find the BAMF Window that is associated with that XID.  Windows BAMF
+   told us about are in our index, anything else requires a bit of
+   searching and gets added to it. */
 static BamfWindow *
 xid_to_bamf_window (IndicatorAppmenu * iapp, guint xid)
 {
+	XidTableEntry * entry = xid_table_lookup(iapp->bamf_windows, xid);
+
+	if (entry != NULL) {
+		return BAMF_WINDOW(entry->data);
+	}
+
+	/* Not one we've been told about, ask BAMF */
 	BamfWindow * newwindow = bamf_matcher_get_window_for_xid(iapp->matcher, xid);
 
-	if (BAMF_IS_WINDOW(newwindow))
+	if (BAMF_IS_WINDOW(newwindow)) {
+		index_bamf_window(iapp, xid, newwindow);
 		return newwindow;
+	}
 
 	BamfApplication *application = bamf_matcher_get_application_for_xid(iapp->matcher, xid);
 	GList * children = bamf_view_peek_children (BAMF_VIEW (application));
@@ -830,6 +1589,7 @@ xid_to_bamf_window (IndicatorAppmenu * iapp, guint xid)
 
 		if (xid == bamf_window_get_xid(testwindow)) {
 			newwindow = testwindow;
+			index_bamf_window(iapp, xid, newwindow);
 			break;
 		}
 	}
@@ -844,6 +1604,10 @@ entry_activate_window (IndicatorObject * io, IndicatorObjectEntry * entry, guint
 	WindowMenu * menus = NULL;
 	IndicatorAppmenu * iapp = INDICATOR_APPMENU(io);
 
+	/* The user is interacting with the menus, a focus change we're
+	   still sitting on can't wait any longer */
+	focus_commit(iapp);
+
 	/* We need to force a focus change in this case as we probably
 	   just haven't gotten the signal from BAMF yet */
 	if (windowid != 0) {
@@ -884,8 +1648,9 @@ window_finalized_is_active (gpointer user_data, GObject * old_window)
 	}
 
 	/* We're going to a state where we don't know what the active
-	   window is, hopefully BAMF will save us */
-	active_window_changed(iapp->matcher, NULL, NULL, iapp);
+	   window is, hopefully BAMF will save us.  Not debounced as we
+	   can't keep pointing at a window that's gone. */
+	update_active_window(iapp, NULL);
 
 	return;
 }
@@ -958,6 +1723,10 @@ connect_to_menu_signals (IndicatorAppmenu * iapp, WindowMenu * menus)
 	                 WINDOW_MENU_SIGNAL_ENTRY_REMOVED,
 	                 G_CALLBACK(window_entry_removed),
 	                 iapp);
+	g_signal_connect(menus,
+	                 WINDOW_MENU_SIGNAL_ENTRY_MOVED,
+	                 G_CALLBACK(window_entry_moved),
+	                 iapp);
 	g_signal_connect(menus,
 	                 WINDOW_MENU_SIGNAL_STATUS_CHANGED,
 	                 G_CALLBACK(window_status_changed),
@@ -972,6 +1741,26 @@ connect_to_menu_signals (IndicatorAppmenu * iapp, WindowMenu * menus)
 	                 iapp);
 }
 
+/* Undo connect_to_menu_signals(), leaving the registry ones alone */
+static void
+disconnect_from_menu_signals (IndicatorAppmenu * iapp, WindowMenu * menus)
+{
+	g_signal_handlers_disconnect_by_func(menus, window_entry_added, iapp);
+	g_signal_handlers_disconnect_by_func(menus, window_entry_removed, iapp);
+	g_signal_handlers_disconnect_by_func(menus, window_entry_moved, iapp);
+	g_signal_handlers_disconnect_by_func(menus, window_status_changed, iapp);
+	g_signal_handlers_disconnect_by_func(menus, window_show_menu, iapp);
+	g_signal_handlers_disconnect_by_func(menus, window_a11y_update, iapp);
+}
+
+/* Keep the entry counts clients see current for every window, not
+   just the one we're showing */
+static void
+registry_entries_changed (WindowMenu * mw, IndicatorObjectEntry * entry, IndicatorAppmenu * iapp)
+{
+	schedule_publish_registry(iapp);
+}
+
 /* Switch applications, remove all the entires for the previous
    one and add them for the new application */
 static void
@@ -1002,10 +1791,11 @@ switch_default_app (IndicatorAppmenu * iapp, WindowMenu * newdef, BamfWindow * a
 	if (iapp->default_app)
 	{
 		/* Disconnect signals */
-		g_signal_handlers_disconnect_by_data(iapp->default_app, iapp);
+		disconnect_from_menu_signals(iapp, iapp->default_app);
 
 		/* Default App is NULL, let's see if it needs replacement */
 		iapp->default_app = NULL;
+		g_atomic_int_set(&iapp->default_xid, 0);
 	}
 
 	/* Update the active window pointer -- may be NULL */
@@ -1015,6 +1805,7 @@ switch_default_app (IndicatorAppmenu * iapp, WindowMenu * newdef, BamfWindow * a
 	if (newdef != NULL) {
 		/* Switch */
 		iapp->default_app = newdef;
+		g_atomic_int_set(&iapp->default_xid, window_menu_get_xid(newdef));
 		connect_to_menu_signals(iapp, iapp->default_app);
 	}
 
@@ -1037,7 +1828,33 @@ track_menus (IndicatorAppmenu * iapp, guint xid, WindowMenu * menus)
 {
 	g_return_if_fail(IS_WINDOW_MENU(menus));
 
-	g_hash_table_insert(iapp->apps, GUINT_TO_POINTER(xid), menus);
+	XidTableEntry * entry = xid_table_insert(iapp->windows, xid);
+	g_return_if_fail(entry != NULL);
+
+	if (entry->data != NULL && entry->data != menus) {
+		g_object_unref(entry->data);
+	}
+	entry->data = menus;
+	entry->backend = IS_WINDOW_MENU_DBUSMENU(menus) ? REGISTRY_BACKEND_DBUSMENU : REGISTRY_BACKEND_MODEL;
+
+	if (g_hash_table_remove(iapp->hibernated, GUINT_TO_POINTER(xid))) {
+		iapp->hibernate_woken++;
+		g_debug("Woke menus for XID %d", xid);
+	}
+	note_focus(iapp, xid);
+
+	/* Tracking the same menus again shouldn't double up */
+	g_signal_handlers_disconnect_by_func(menus, registry_entries_changed, iapp);
+	g_signal_connect(menus,
+	                 WINDOW_MENU_SIGNAL_ENTRY_ADDED,
+	                 G_CALLBACK(registry_entries_changed),
+	                 iapp);
+	g_signal_connect(menus,
+	                 WINDOW_MENU_SIGNAL_ENTRY_REMOVED,
+	                 G_CALLBACK(registry_entries_changed),
+	                 iapp);
+
+	publish_registry(iapp);
 
 	if (iapp->mode == MODE_UNITY_ALL_MENUS) {
 		GList *entries, *l;
@@ -1064,11 +1881,33 @@ ensure_menus (IndicatorAppmenu * iapp, BamfWindow * window)
 {
 	WindowMenu * menus = NULL;
 	guint32 xid = 0;
+	GArray * walked = NULL;
 
 	while (window != NULL && menus == NULL) {
 		xid = bamf_window_get_xid(window);
 
-		menus = g_hash_table_lookup(iapp->apps, GUINT_TO_POINTER(xid));
+		menus = lookup_menus(iapp, xid);
+
+		if (menus == NULL) {
+			menus = wake_menus(iapp, xid);
+		}
+
+		/* We've walked up from this one before, if the window we
+		   found still has its menus we can stop here */
+		if (menus == NULL) {
+			XidTableEntry * memo = xid_table_lookup(iapp->transient_owners, xid);
+
+			if (memo != NULL) {
+				guint32 owner = GPOINTER_TO_UINT(memo->data);
+				menus = lookup_menus(iapp, owner);
+
+				if (menus != NULL) {
+					xid = owner;
+				} else {
+					xid_table_remove(iapp->transient_owners, xid);
+				}
+			}
+		}
 
 		/* First look to see if we can get these from the
 		   GMenuModel access */
@@ -1078,7 +1917,7 @@ ensure_menus (IndicatorAppmenu * iapp, BamfWindow * window)
 			if (uniquename != NULL) {
 				BamfApplication * app = bamf_matcher_get_application_for_window(iapp->matcher, window);
 
-				menus = WINDOW_MENU(window_menu_model_new(app, window));
+				menus = WINDOW_MENU(window_menu_model_new(app, window, menu_layout(iapp, SETTINGS_MODEL_LAYOUT, WINDOW_MENU_LAYOUT_ON_DEMAND)));
 				track_menus(iapp, xid, menus);
 			}
 
@@ -1087,19 +1926,224 @@ ensure_menus (IndicatorAppmenu * iapp, BamfWindow * window)
 
 		if (menus == NULL) {
 			g_debug("Looking for parent window on XID %d", xid);
+
+			if (walked == NULL) {
+				walked = g_array_new(FALSE, FALSE, sizeof(guint32));
+			}
+			g_array_append_val(walked, xid);
+
 			window = bamf_window_get_transient(window);
 		}
 	}
 
+	/* Remember where each window we went through got its menus.  Not
+	   finding any isn't remembered, the app may register later. */
+	if (walked != NULL) {
+		if (menus != NULL) {
+			guint i;
+			for (i = 0; i < walked->len; i++) {
+				XidTableEntry * entry = xid_table_insert(iapp->transient_owners, g_array_index(walked, guint32, i));
+				entry->data = GUINT_TO_POINTER(xid);
+			}
+		}
+
+		g_array_free(walked, TRUE);
+	}
+
 	return menus;
 }
 
+/* A window went away, it can't own or be a transient anymore */
+static void
+forget_transients (IndicatorAppmenu * iapp, guint32 xid)
+{
+	XidTableIter iter;
+	XidTableEntry * entry;
+	GArray * children = NULL;
+
+	xid_table_remove(iapp->transient_owners, xid);
+
+	xid_table_iter_init(&iter, iapp->transient_owners);
+	while (xid_table_iter_next(&iter, &entry)) {
+		if (GPOINTER_TO_UINT(entry->data) == xid) {
+			if (children == NULL) {
+				children = g_array_new(FALSE, FALSE, sizeof(guint32));
+			}
+			g_array_append_val(children, entry->xid);
+		}
+	}
+
+	if (children != NULL) {
+		guint i;
+		for (i = 0; i < children->len; i++) {
+			xid_table_remove(iapp->transient_owners, g_array_index(children, guint32, i));
+		}
+		g_array_free(children, TRUE);
+	}
+
+	return;
+}
+
+/* The pending window wants its menu shown, it can't wait */
+static void
+focus_pending_show_menu (WindowMenu * mw, IndicatorObjectEntry * entry, guint timestamp, gpointer user_data)
+{
+	IndicatorAppmenu * iapp = INDICATOR_APPMENU(user_data);
+
+	focus_commit(iapp);
+
+	if (iapp->default_app == mw) {
+		window_show_menu(mw, entry, timestamp, iapp);
+	}
+}
+
+/* The pending window wants its underlines shown */
+static void
+focus_pending_status_changed (WindowMenu * mw, DbusmenuStatus status, gpointer user_data)
+{
+	IndicatorAppmenu * iapp = INDICATOR_APPMENU(user_data);
+
+	focus_commit(iapp);
+
+	if (iapp->default_app == mw) {
+		window_status_changed(mw, status, iapp);
+	}
+}
+
+/* Stop listening to the pending window's menus */
+static void
+focus_release_menus (IndicatorAppmenu * iapp)
+{
+	WindowMenu * menus = iapp->focus_pending_menus;
+
+	if (menus == NULL) {
+		return;
+	}
+
+	g_signal_handlers_disconnect_by_func(menus, focus_pending_show_menu, iapp);
+	g_signal_handlers_disconnect_by_func(menus, focus_pending_status_changed, iapp);
+	g_object_remove_weak_pointer(G_OBJECT(menus), (gpointer *)&iapp->focus_pending_menus);
+	iapp->focus_pending_menus = NULL;
+}
+
+/* Listen for the menu key on the menus a pending window already
+   has.  Nothing gets built for it here, that's what we're waiting
+   for.  The menus being shown, or every window's in all-menus mode,
+   are passed up already. */
+static void
+focus_watch_menus (IndicatorAppmenu * iapp, BamfWindow * window)
+{
+	if (iapp->mode == MODE_UNITY_ALL_MENUS) {
+		return;
+	}
+
+	guint32 xid = bamf_window_get_xid(window);
+	WindowMenu * menus = lookup_menus(iapp, xid);
+
+	if (menus == NULL) {
+		XidTableEntry * memo = xid_table_lookup(iapp->transient_owners, xid);
+
+		if (memo != NULL) {
+			menus = lookup_menus(iapp, GPOINTER_TO_UINT(memo->data));
+		}
+	}
+
+	if (menus == NULL || menus == iapp->default_app) {
+		return;
+	}
+
+	iapp->focus_pending_menus = menus;
+	g_object_add_weak_pointer(G_OBJECT(menus), (gpointer *)&iapp->focus_pending_menus);
+
+	g_signal_connect(menus,
+	                 WINDOW_MENU_SIGNAL_SHOW_MENU,
+	                 G_CALLBACK(focus_pending_show_menu),
+	                 iapp);
+	g_signal_connect(menus,
+	                 WINDOW_MENU_SIGNAL_STATUS_CHANGED,
+	                 G_CALLBACK(focus_pending_status_changed),
+	                 iapp);
+}
+
 /* Recieve the signal that the window being shown
    has now changed. */
 static void
 active_window_changed (BamfMatcher * matcher, BamfView * oldview, BamfView * newview, gpointer user_data)
 {
-	update_active_window(INDICATOR_APPMENU(user_data), (BamfWindow *) newview);
+	IndicatorAppmenu * iapp = INDICATOR_APPMENU(user_data);
+	guint delay = FOCUS_DEBOUNCE_DEFAULT;
+
+	if (iapp->settings != NULL) {
+		delay = g_settings_get_uint(iapp->settings, SETTINGS_FOCUS_DEBOUNCE);
+	}
+
+	if (iapp->focus_pending != NULL) {
+		g_object_remove_weak_pointer(G_OBJECT(iapp->focus_pending), (gpointer *)&iapp->focus_pending);
+		iapp->focus_pending = NULL;
+	}
+	focus_release_menus(iapp);
+
+	if (iapp->focus_timer != 0) {
+		g_source_remove(iapp->focus_timer);
+		iapp->focus_timer = 0;
+	}
+
+	if (delay == 0) {
+		update_active_window(iapp, (BamfWindow *) newview);
+		return;
+	}
+
+	/* Alt-tab walks through every window on the way, only the one
+	   it stops on gets its menus shown */
+	iapp->focus_pending = (BamfWindow *) newview;
+	if (newview != NULL) {
+		g_object_add_weak_pointer(G_OBJECT(newview), (gpointer *)&iapp->focus_pending);
+		focus_watch_menus(iapp, BAMF_WINDOW(newview));
+	}
+
+	iapp->focus_timer = g_timeout_add(delay, focus_timeout, iapp);
+}
+
+/* Show the menus for the window of the last focus change.  A
+   pending window that has since gone away leaves us with no active
+   window, like BAMF telling us so would. */
+static void
+focus_apply (IndicatorAppmenu * iapp)
+{
+	BamfWindow * window = iapp->focus_pending;
+
+	if (window != NULL) {
+		g_object_remove_weak_pointer(G_OBJECT(window), (gpointer *)&iapp->focus_pending);
+		iapp->focus_pending = NULL;
+	}
+	focus_release_menus(iapp);
+
+	update_active_window(iapp, window);
+}
+
+/* Focus has settled */
+static gboolean
+focus_timeout (gpointer user_data)
+{
+	IndicatorAppmenu * iapp = INDICATOR_APPMENU(user_data);
+
+	iapp->focus_timer = 0;
+	focus_apply(iapp);
+
+	return G_SOURCE_REMOVE;
+}
+
+/* Don't wait for focus to settle, switch now if a change is pending */
+static void
+focus_commit (IndicatorAppmenu * iapp)
+{
+	if (iapp->focus_timer == 0) {
+		return;
+	}
+
+	g_source_remove(iapp->focus_timer);
+	iapp->focus_timer = 0;
+	focus_apply(iapp);
 }
 
 static WindowMenu *
@@ -1131,6 +2175,11 @@ update_active_window (IndicatorAppmenu * appmenu, BamfWindow *window)
 
 	g_debug("Switching to menus from XID %d", window ? bamf_window_get_xid(window) : 0);
 	menus = ensure_menus(appmenu, window);
+	preload_claim(appmenu, menus);
+
+	if (menus != NULL) {
+		note_focus(appmenu, window_menu_get_xid(menus));
+	}
 	switch_default_app(appmenu, menus, window);
 
 	return menus;
@@ -1142,10 +2191,13 @@ static void
 menus_destroyed (IndicatorAppmenu * iapp, guint windowid)
 {
 	gboolean reload_menus = FALSE;
-	WindowMenu * wm = g_hash_table_lookup(iapp->apps, GUINT_TO_POINTER(windowid));
+	WindowMenu * wm = lookup_menus(iapp, windowid);
 	g_return_if_fail (IS_WINDOW_MENU(wm));
 
-	g_hash_table_steal(iapp->apps, GUINT_TO_POINTER(windowid));
+	/* Steal our reference, it's dropped at the end */
+	xid_table_lookup(iapp->windows, windowid)->data = NULL;
+	forget_window(iapp, windowid);
+	publish_registry(iapp);
 	g_signal_handlers_disconnect_by_data(wm, iapp);
 
 	g_debug("Removing menus for %d", windowid);
@@ -1187,8 +2239,8 @@ register_window (IndicatorAppmenu * iapp, guint windowid, const gchar * objectpa
 {
 	g_debug("Registering window ID %d with path %s from %s", windowid, objectpath, sender);
 
-	if (g_hash_table_lookup(iapp->apps, GUINT_TO_POINTER(windowid)) == NULL && windowid != 0) {
-		WindowMenu * wm = WINDOW_MENU(window_menu_dbusmenu_new(windowid, sender, objectpath));
+	if (lookup_menus(iapp, windowid) == NULL && windowid != 0) {
+		WindowMenu * wm = WINDOW_MENU(window_menu_dbusmenu_new(windowid, sender, objectpath, menu_layout(iapp, SETTINGS_DBUSMENU_LAYOUT, WINDOW_MENU_LAYOUT_FULL)));
 		g_return_val_if_fail(wm != NULL, FALSE);
 
 		track_menus(iapp, windowid, wm);
@@ -1196,14 +2248,17 @@ register_window (IndicatorAppmenu * iapp, guint windowid, const gchar * objectpa
 		emit_signal(iapp, "WindowRegistered",
 		            g_variant_new("(uso)", windowid, sender, objectpath));
 
-		gpointer pdesktop = g_hash_table_lookup(iapp->desktop_windows, GUINT_TO_POINTER(windowid));
-		if (pdesktop != NULL) {
+		XidTableEntry * entry = xid_table_lookup(iapp->windows, windowid);
+		if (entry != NULL && (entry->flags & XID_TABLE_FLAG_DESKTOP)) {
 			determine_new_desktop(iapp);
 		}
 
-		/* Note: Does not cause ref */
-		BamfWindow * win = bamf_matcher_get_active_window(iapp->matcher);
-		update_active_window(iapp, win);
+		/* Note: Does not cause ref.  While focus is still settling
+		   the pending switch picks these menus up itself. */
+		if (iapp->focus_timer == 0) {
+			BamfWindow * win = bamf_matcher_get_active_window(iapp->matcher);
+			update_active_window(iapp, win);
+		}
 	} else {
 		if (windowid == 0) {
 			g_warning("Can't build windows for a NULL window ID %d with path %s from %s", windowid, objectpath, sender);
@@ -1216,7 +2271,7 @@ register_window (IndicatorAppmenu * iapp, guint windowid, const gchar * objectpa
 			   with a pretty complex set of functions we want to ensure that
 			   we're not going to end up infinitely recursive otherwise things
 			   could go really bad. */
-			if (g_hash_table_lookup(iapp->apps, GUINT_TO_POINTER(windowid)) == NULL) {
+			if (lookup_menus(iapp, windowid) == NULL) {
 				return register_window(iapp, windowid, objectpath, sender);
 			}
 
@@ -1235,92 +2290,219 @@ unregister_window (IndicatorAppmenu * iapp, guint windowid)
 	g_return_val_if_fail(IS_INDICATOR_APPMENU(iapp), NULL);
 	g_return_val_if_fail(iapp->matcher != NULL, NULL);
 
-	/* If it's a desktop window remove it from that table as well */
-	g_hash_table_remove(iapp->desktop_windows, GUINT_TO_POINTER(windowid));
+	/* If it's a desktop window it isn't anymore */
+	XidTableEntry * entry = xid_table_lookup(iapp->windows, windowid);
+	if (entry != NULL) {
+		entry->flags &= ~XID_TABLE_FLAG_DESKTOP;
+		forget_window(iapp, windowid);
+	}
+
+	g_hash_table_remove(iapp->focus_times, GUINT_TO_POINTER(windowid));
 
 	emit_signal(iapp, "WindowUnregistered", g_variant_new ("(u)", windowid));
 
+	/* Nothing to tear down for a sleeping one */
+	if (g_hash_table_remove(iapp->hibernated, GUINT_TO_POINTER(windowid))) {
+		publish_registry(iapp);
+		return NULL;
+	}
+
 	menus_destroyed(iapp, windowid);
 
 	return NULL;
 }
 
+/* Rebuild the registry snapshot and swap it in for readers.  Called
+   on the main thread whenever the set of menus changes. */
+static void
+publish_registry (IndicatorAppmenu * iapp)
+{
+	GArray * records = g_array_sized_new(FALSE, TRUE, sizeof(RegistryRecord), xid_table_size(iapp->windows));
+	XidTableIter iter;
+	XidTableEntry * value;
+
+	if (iapp->registry_idle != 0) {
+		g_source_remove(iapp->registry_idle);
+		iapp->registry_idle = 0;
+	}
+
+	xid_table_iter_init(&iter, iapp->windows);
+	while (xid_table_iter_next(&iter, &value)) {
+		if (value->data == NULL) {
+			continue;
+		}
+
+		WindowMenu * wm = WINDOW_MENU(value->data);
+		RegistryRecord record = { 0 };
+		GList * entries = window_menu_get_entries(wm);
+
+		record.xid = value->xid;
+		record.backend = value->backend;
+		record.entry_count = g_list_length(entries);
+		g_list_free(entries);
+
+		if (record.backend == REGISTRY_BACKEND_DBUSMENU) {
+			record.address = window_menu_dbusmenu_get_address(WINDOW_MENU_DBUSMENU(wm));
+			record.path = window_menu_dbusmenu_get_path(WINDOW_MENU_DBUSMENU(wm));
+		}
+
+		g_array_append_val(records, record);
+	}
+
+	/* Sleeping windows still have menus as far as clients know */
+	GHashTableIter hash_iter;
+	gpointer key, data;
+
+	g_hash_table_iter_init(&hash_iter, iapp->hibernated);
+	while (g_hash_table_iter_next(&hash_iter, &key, &data)) {
+		HibernatedWindow * hw = (HibernatedWindow *)data;
+		RegistryRecord record = { 0 };
+
+		record.xid = GPOINTER_TO_UINT(key);
+		record.backend = hw->backend;
+		record.entry_count = g_strv_length(hw->labels);
+		record.address = g_strdup(hw->address);
+		record.path = g_strdup(hw->path);
+
+		g_array_append_val(records, record);
+	}
+
+	RegistrySnapshot * snapshot = registry_snapshot_new(records);
+
+	/* Only the pointer swap is done under the lock, readers hold
+	   their own reference to the old one */
+	g_mutex_lock(&iapp->registry_lock);
+	RegistrySnapshot * old = iapp->registry;
+	iapp->registry = snapshot;
+	g_mutex_unlock(&iapp->registry_lock);
+
+	if (old != NULL) {
+		registry_snapshot_unref(old);
+	}
+}
+
+static gboolean
+publish_registry_idle (gpointer user_data)
+{
+	IndicatorAppmenu * iapp = INDICATOR_APPMENU(user_data);
+
+	iapp->registry_idle = 0;
+	publish_registry(iapp);
+
+	return G_SOURCE_REMOVE;
+}
+
+/* Entry counts change in bursts, fold them into one snapshot */
+static void
+schedule_publish_registry (IndicatorAppmenu * iapp)
+{
+	if (iapp->registry_idle == 0) {
+		iapp->registry_idle = g_idle_add(publish_registry_idle, iapp);
+	}
+}
+
+/* Get a reference to the current registry snapshot, from any thread */
+static RegistrySnapshot *
+registry_ref (IndicatorAppmenu * iapp)
+{
+	RegistrySnapshot * snapshot = NULL;
+
+	g_mutex_lock(&iapp->registry_lock);
+	if (iapp->registry != NULL) {
+		snapshot = registry_snapshot_ref(iapp->registry);
+	}
+	g_mutex_unlock(&iapp->registry_lock);
+
+	return snapshot;
+}
+
 /* Grab the menu information for a specific window */
 static GVariant *
 get_menu_for_window (IndicatorAppmenu * iapp, guint windowid, GError ** error)
 {
-	WindowMenu * wm = NULL;
-
 	if (windowid == 0) {
-		wm = iapp->default_app;
-	} else {
-		wm = WINDOW_MENU(g_hash_table_lookup(iapp->apps, GUINT_TO_POINTER(windowid)));
+		windowid = g_atomic_int_get(&iapp->default_xid);
 	}
 
-	if (wm == NULL) {
-		g_set_error_literal(error, error_quark(), ERROR_WINDOW_NOT_FOUND, "Window not found");
-		return NULL;
-	}
+	RegistrySnapshot * snapshot = registry_ref(iapp);
+	GVariant * retval = NULL;
 
-	GVariantBuilder builder;
-	g_variant_builder_init(&builder, G_VARIANT_TYPE_TUPLE);
+	if (snapshot != NULL) {
+		const RegistryRecord * record = registry_snapshot_lookup(snapshot, windowid);
 
-	if (IS_WINDOW_MENU_DBUSMENU(wm)) {
-		gchar * address = window_menu_dbusmenu_get_address(WINDOW_MENU_DBUSMENU(wm));
-		gchar * path = window_menu_dbusmenu_get_path(WINDOW_MENU_DBUSMENU(wm));
-		g_variant_builder_add_value(&builder, g_variant_new_string(address));
-		g_variant_builder_add_value(&builder, g_variant_new_object_path(path));
-		g_free(path);
-		g_free(address);
-	} else {
-		g_variant_builder_add_value(&builder, g_variant_new_string(""));
-		g_variant_builder_add_value(&builder, g_variant_new_object_path("/"));
+		if (record != NULL && windowid != 0) {
+			retval = g_variant_new("(so)",
+			                       record->address != NULL ? record->address : "",
+			                       record->path != NULL ? record->path : "/");
+		}
+
+		registry_snapshot_unref(snapshot);
 	}
 
-	return g_variant_builder_end(&builder);
+	if (retval == NULL) {
+		g_set_error_literal(error, error_quark(), ERROR_WINDOW_NOT_FOUND, "Window not found");
+	}
+
+	return retval;
 }
 
-/* Get all the menus we have */
+/* Get all the menus we have.  The reply is built with the snapshot,
+   this returns a reference to it that the caller drops. */
 static GVariant *
 get_menus (IndicatorAppmenu * iapp, GError ** error)
 {
-	if (iapp->apps == NULL) {
+	RegistrySnapshot * snapshot = registry_ref(iapp);
+
+	if (snapshot == NULL) {
 		g_set_error_literal(error, error_quark(), ERROR_NO_APPLICATIONS, "No applications are registered");
 		return NULL;
 	}
 
-	GVariantBuilder builder;
-	GHashTableIter hash_iter;
-	gpointer value;
-
-	g_variant_builder_init (&builder, G_VARIANT_TYPE("a(uso)"));
-	g_hash_table_iter_init (&hash_iter, iapp->apps);
-	while (g_hash_table_iter_next (&hash_iter, NULL, &value)) {
-		if (value != NULL) {
-			WindowMenu * wm = WINDOW_MENU(value);
-			if (IS_WINDOW_MENU_DBUSMENU(wm)) {
-				gchar * address = window_menu_dbusmenu_get_address(WINDOW_MENU_DBUSMENU(wm));
-				gchar * path = window_menu_dbusmenu_get_path(WINDOW_MENU_DBUSMENU(wm));
-				g_variant_builder_add (&builder, "(uso)",
-				                       window_menu_get_xid(wm),
-				                       address,
-				                       path);
-				g_free(path);
-				g_free(address);
-			} else {
-				g_variant_builder_add (&builder, "(uso)",
-				                       window_menu_get_xid(wm),
-				                       "",
-				                       "/");
-			}
-		}
+	GVariant * retval = g_variant_ref(registry_snapshot_get_menus(snapshot));
+	registry_snapshot_unref(snapshot);
+
+	return retval;
+}
+
+/* Registration changes the menus we show, so it's handled back on
+   the main thread */
+static gboolean
+main_method_call (gpointer user_data)
+{
+	GDBusMethodInvocation * invocation = G_DBUS_METHOD_INVOCATION(user_data);
+	IndicatorAppmenu * iapp = INDICATOR_APPMENU(g_dbus_method_invocation_get_user_data(invocation));
+	const gchar * method = g_dbus_method_invocation_get_method_name(invocation);
+	GVariant * params = g_dbus_method_invocation_get_parameters(invocation);
+	GVariant * retval = NULL;
+
+	if (iapp->disposed) {
+		g_dbus_method_invocation_return_dbus_error(invocation,
+		                                           "org.ayatana.AppMenu.Error",
+		                                           "The registrar is shutting down");
+		g_object_unref(iapp);
+		return G_SOURCE_REMOVE;
 	}
 
-	return g_variant_new ("(a(uso))", &builder);
+	if (g_strcmp0(method, "RegisterWindow") == 0) {
+		guint32 xid;
+		const gchar * path;
+		g_variant_get(params, "(u&o)", &xid, &path);
+		retval = register_window(iapp, xid, path, g_dbus_method_invocation_get_sender(invocation));
+	} else if (g_strcmp0(method, "UnregisterWindow") == 0) {
+		guint32 xid;
+		g_variant_get(params, "(u)", &xid);
+		retval = unregister_window(iapp, xid);
+	}
+
+	g_dbus_method_invocation_return_value(invocation, retval);
+
+	/* Taken when the call was queued */
+	g_object_unref(iapp);
+	return G_SOURCE_REMOVE;
 }
 
 /* A method has been called from our dbus inteface.  Figure out what it
-   is and dispatch it. */
+   is and dispatch it.  This runs on the worker thread. */
 static void
 bus_method_call (GDBusConnection * connection, const gchar * sender,
                  const gchar * object_path, const gchar * interface,
@@ -1331,15 +2513,12 @@ bus_method_call (GDBusConnection * connection, const gchar * sender,
 	GVariant * retval = NULL;
 	GError * error = NULL;
 
-	if (g_strcmp0(method, "RegisterWindow") == 0) {
-		guint32 xid;
-		const gchar * path;
-		g_variant_get(params, "(u&o)", &xid, &path);
-		retval = register_window(iapp, xid, path, sender);
-	} else if (g_strcmp0(method, "UnregisterWindow") == 0) {
-		guint32 xid;
-		g_variant_get(params, "(u)", &xid);
-		retval = unregister_window(iapp, xid);
+	if (g_strcmp0(method, "RegisterWindow") == 0 || g_strcmp0(method, "UnregisterWindow") == 0) {
+		/* The invocation is ours until we return a value on it, and
+		   the ref keeps us around until the main thread gets to it */
+		g_object_ref(iapp);
+		g_main_context_invoke_full(NULL, G_PRIORITY_DEFAULT, main_method_call, invocation, NULL);
+		return;
 	} else if (g_strcmp0(method, "GetMenuForWindow") == 0) {
 		guint32 xid;
 		g_variant_get(params, "(u)", &xid);
@@ -1355,8 +2534,15 @@ bus_method_call (GDBusConnection * connection, const gchar * sender,
 		                                           "org.ayatana.AppMenu.Error",
 		                                           error->message);
 		g_error_free(error);
-	} else {
+	} else if (retval != NULL) {
+		/* GetMenus gives us a reference to the snapshot's reply while
+		   the others are floating, and the invocation takes its own
+		   either way.  Own them all so ours can be dropped. */
+		g_variant_take_ref(retval);
 		g_dbus_method_invocation_return_value(invocation, retval);
+		g_variant_unref(retval);
+	} else {
+		g_dbus_method_invocation_return_value(invocation, NULL);
 	}
 	return;
 }
@@ -1366,7 +2552,7 @@ static void
 window_entry_added (WindowMenu * mw, IndicatorObjectEntry * entry, IndicatorAppmenu * iapp)
 {
 	entry->parent_object = INDICATOR_OBJECT(iapp);
-	g_signal_emit_by_name(G_OBJECT(iapp), INDICATOR_OBJECT_SIGNAL_ENTRY_ADDED, entry);
+	g_signal_emit(G_OBJECT(iapp), io_signals[IO_ENTRY_ADDED], 0, entry);
 }
 
 /* Pass up the entry removed event */
@@ -1374,7 +2560,51 @@ static void
 window_entry_removed (WindowMenu * mw, IndicatorObjectEntry * entry, IndicatorAppmenu * iapp)
 {
 	entry->parent_object = INDICATOR_OBJECT(iapp);
-	g_signal_emit_by_name(G_OBJECT(iapp), INDICATOR_OBJECT_SIGNAL_ENTRY_REMOVED, entry);
+	g_signal_emit(G_OBJECT(iapp), io_signals[IO_ENTRY_REMOVED], 0, entry);
+}
+
+/* Where a window's entries start in the list get_entries() gives in
+   all-menus mode.  That has the windows the other way round from how
+   the table iterates, so it's the entries of the windows after it. */
+static guint
+all_menus_offset (IndicatorAppmenu * iapp, WindowMenu * mw)
+{
+	XidTableIter iter;
+	XidTableEntry * value;
+	gboolean found = FALSE;
+	guint offset = 0;
+
+	xid_table_iter_init(&iter, iapp->windows);
+	while (xid_table_iter_next(&iter, &value)) {
+		if (value->data == NULL) {
+			continue;
+		}
+
+		if (found) {
+			GList * entries = window_menu_get_entries(WINDOW_MENU(value->data));
+			offset += g_list_length(entries);
+			g_list_free(entries);
+		} else if (value->data == mw) {
+			found = TRUE;
+		}
+	}
+
+	return offset;
+}
+
+/* Pass up the entry moved event, the positions are within the
+   window's own entries */
+static void
+window_entry_moved (WindowMenu * mw, IndicatorObjectEntry * entry, guint old_pos, guint new_pos, IndicatorAppmenu * iapp)
+{
+	if (iapp->mode == MODE_UNITY_ALL_MENUS) {
+		guint offset = all_menus_offset(iapp, mw);
+		old_pos += offset;
+		new_pos += offset;
+	}
+
+	entry->parent_object = INDICATOR_OBJECT(iapp);
+	g_signal_emit(G_OBJECT(iapp), io_signals[IO_ENTRY_MOVED], 0, entry, (gint)old_pos, (gint)new_pos);
 }
 
 /* Pass up the status changed event */
@@ -1395,14 +2625,14 @@ window_status_changed (WindowMenu * mw, DbusmenuStatus status, IndicatorAppmenu
 static void
 window_show_menu (WindowMenu * mw, IndicatorObjectEntry * entry, guint timestamp, gpointer user_data)
 {
-	g_signal_emit_by_name(G_OBJECT(user_data), INDICATOR_OBJECT_SIGNAL_MENU_SHOW, entry, timestamp);
+	g_signal_emit(G_OBJECT(user_data), io_signals[IO_MENU_SHOW], 0, entry, timestamp);
 }
 
 /* Pass up the accessible string update */
 static void
 window_a11y_update (WindowMenu * mw, IndicatorObjectEntry * entry, gpointer user_data)
 {
-	g_signal_emit_by_name(G_OBJECT(user_data), INDICATOR_OBJECT_SIGNAL_ACCESSIBLE_DESC_UPDATE, entry);
+	g_signal_emit(G_OBJECT(user_data), io_signals[IO_ACCESSIBLE_DESC_UPDATE], 0, entry);
 }
 
 /**********************
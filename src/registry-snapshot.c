@@ -0,0 +1,158 @@
+/*
+An immutable view of the windows that have registered menus.
+
+Copyright 2017 Ayatana Indicators Project
+
+This program is free software: you can redistribute it and/or modify it 
+under the terms of the GNU General Public License version 3, as published 
+by the Free Software Foundation.
+
+This program is distributed in the hope that it will be useful, but 
+WITHOUT ANY WARRANTY; without even the implied warranties of 
+MERCHANTABILITY, SATISFACTORY QUALITY, or FITNESS FOR A PARTICULAR 
+PURPOSE.  See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along 
+with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "registry-snapshot.h"
+
+/* Nothing in here changes after it's created, so any thread holding
+   a reference can read it without locking */
+struct _RegistrySnapshot {
+	gint ref_count;
+	GArray * records;
+	GVariant * menus;
+};
+
+static gint
+record_compare (gconstpointer a, gconstpointer b)
+{
+	const RegistryRecord * ra = (const RegistryRecord *)a;
+	const RegistryRecord * rb = (const RegistryRecord *)b;
+
+	if (ra->xid < rb->xid) {
+		return -1;
+	}
+	if (ra->xid > rb->xid) {
+		return 1;
+	}
+	return 0;
+}
+
+/* Takes the records array, and the strings in it */
+RegistrySnapshot *
+registry_snapshot_new (GArray * records)
+{
+	g_return_val_if_fail(records != NULL, NULL);
+
+	RegistrySnapshot * snapshot = g_new0(RegistrySnapshot, 1);
+	snapshot->ref_count = 1;
+	snapshot->records = records;
+
+	/* Sorted so lookups can bisect */
+	g_array_sort(snapshot->records, record_compare);
+
+	/* GetMenus is asked for over and over by monitoring tools, build
+	   its reply once */
+	GVariantBuilder builder;
+	guint i;
+
+	g_variant_builder_init(&builder, G_VARIANT_TYPE("a(uso)"));
+	for (i = 0; i < snapshot->records->len; i++) {
+		RegistryRecord * record = &g_array_index(snapshot->records, RegistryRecord, i);
+		g_variant_builder_add(&builder, "(uso)",
+		                      record->xid,
+		                      record->address != NULL ? record->address : "",
+		                      record->path != NULL ? record->path : "/");
+	}
+	snapshot->menus = g_variant_ref_sink(g_variant_new("(a(uso))", &builder));
+
+	return snapshot;
+}
+
+RegistrySnapshot *
+registry_snapshot_ref (RegistrySnapshot * snapshot)
+{
+	g_return_val_if_fail(snapshot != NULL, NULL);
+
+	g_atomic_int_inc(&snapshot->ref_count);
+	return snapshot;
+}
+
+void
+registry_snapshot_unref (RegistrySnapshot * snapshot)
+{
+	g_return_if_fail(snapshot != NULL);
+
+	if (!g_atomic_int_dec_and_test(&snapshot->ref_count)) {
+		return;
+	}
+
+	guint i;
+	for (i = 0; i < snapshot->records->len; i++) {
+		RegistryRecord * record = &g_array_index(snapshot->records, RegistryRecord, i);
+		g_free(record->address);
+		g_free(record->path);
+	}
+
+	g_array_free(snapshot->records, TRUE);
+	g_variant_unref(snapshot->menus);
+	g_free(snapshot);
+
+	return;
+}
+
+guint
+registry_snapshot_get_length (RegistrySnapshot * snapshot)
+{
+	g_return_val_if_fail(snapshot != NULL, 0);
+	return snapshot->records->len;
+}
+
+const RegistryRecord *
+registry_snapshot_get_record (RegistrySnapshot * snapshot, guint index)
+{
+	g_return_val_if_fail(snapshot != NULL, NULL);
+	g_return_val_if_fail(index < snapshot->records->len, NULL);
+
+	return &g_array_index(snapshot->records, RegistryRecord, index);
+}
+
+/* Find the record for a window, NULL if it doesn't have menus */
+const RegistryRecord *
+registry_snapshot_lookup (RegistrySnapshot * snapshot, guint xid)
+{
+	g_return_val_if_fail(snapshot != NULL, NULL);
+
+	guint low = 0;
+	guint high = snapshot->records->len;
+
+	while (low < high) {
+		guint mid = low + (high - low) / 2;
+		RegistryRecord * record = &g_array_index(snapshot->records, RegistryRecord, mid);
+
+		if (record->xid == xid) {
+			return record;
+		} else if (record->xid < xid) {
+			low = mid + 1;
+		} else {
+			high = mid;
+		}
+	}
+
+	return NULL;
+}
+
+/* The GetMenus reply, owned by the snapshot */
+GVariant *
+registry_snapshot_get_menus (RegistrySnapshot * snapshot)
+{
+	g_return_val_if_fail(snapshot != NULL, NULL);
+	return snapshot->menus;
+}
@@ -0,0 +1,54 @@
+/*
+An immutable view of the windows that have registered menus.
+
+Copyright 2017 Ayatana Indicators Project
+
+This program is free software: you can redistribute it and/or modify it 
+under the terms of the GNU General Public License version 3, as published 
+by the Free Software Foundation.
+
+This program is distributed in the hope that it will be useful, but 
+WITHOUT ANY WARRANTY; without even the implied warranties of 
+MERCHANTABILITY, SATISFACTORY QUALITY, or FITNESS FOR A PARTICULAR 
+PURPOSE.  See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along 
+with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __REGISTRY_SNAPSHOT_H__
+#define __REGISTRY_SNAPSHOT_H__
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+typedef enum _RegistryBackend RegistryBackend;
+enum _RegistryBackend {
+	REGISTRY_BACKEND_DBUSMENU,
+	REGISTRY_BACKEND_MODEL
+};
+
+typedef struct _RegistryRecord RegistryRecord;
+struct _RegistryRecord {
+	guint xid;
+	gchar * address;
+	gchar * path;
+	RegistryBackend backend;
+	guint entry_count;
+};
+
+typedef struct _RegistrySnapshot RegistrySnapshot;
+
+RegistrySnapshot * registry_snapshot_new (GArray * records);
+RegistrySnapshot * registry_snapshot_ref (RegistrySnapshot * snapshot);
+void registry_snapshot_unref (RegistrySnapshot * snapshot);
+
+guint registry_snapshot_get_length (RegistrySnapshot * snapshot);
+const RegistryRecord * registry_snapshot_get_record (RegistrySnapshot * snapshot, guint index);
+const RegistryRecord * registry_snapshot_lookup (RegistrySnapshot * snapshot, guint xid);
+GVariant * registry_snapshot_get_menus (RegistrySnapshot * snapshot);
+
+G_END_DECLS
+
+#endif
@@ -26,11 +26,14 @@ with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include <gtk/gtk.h>
 
 #include <libdbusmenu-gtk/menu.h>
+#include <libdbusmenu-gtk/menuitem.h>
 #include <glib.h>
 #include <gio/gio.h>
 
 #include "window-menu-dbusmenu.h"
 #include "indicator-appmenu-marshal.h"
+#include "icon-cache.h"
+#include "entry-slab.h"
 
 /* Private parts */
 
@@ -38,14 +41,37 @@ typedef struct _WindowMenuDbusmenuPrivate WindowMenuDbusmenuPrivate;
 struct _WindowMenuDbusmenuPrivate {
 	guint windowid;
 	DbusmenuGtkClient * client;
+	GtkAccelGroup * accel_group;
 	DbusmenuMenuitem * root;
 	GCancellable * props_cancel;
 	GDBusProxy * props;
 	GArray * entries;
+	GArray * stale_entries;
+	EntrySlab * slab;
+	gboolean diffing;
+	GPtrArray * diff_pending;
+	guint diff_timer;
 	gboolean error_state;
 	guint   retry_timer;
+	gdouble update_tokens;
+	gint64  update_time;
+	guint   resync_timer;
+	guint   throttled;
+	guint   throttled_reported;
+	WindowMenuLayout layout;
 };
 
+/* Token bucket for the updates a client can send us.  Once it runs
+   dry the updates are dropped and the whole root is resynced after
+   a short delay instead. */
+#define UPDATE_BUCKET_SIZE   200.0
+#define UPDATE_REFILL_RATE   100.0 /* per second */
+#define UPDATE_RESYNC_DELAY  250   /* ms */
+
+/* How long a root change waits for its items to be realized before
+   the host is told about it, later ones are added as they come */
+#define DIFF_REALIZE_TIMEOUT 500   /* ms */
+
 typedef struct _WMEntry WMEntry;
 struct _WMEntry {
 	IndicatorObjectEntry ioentry;
@@ -53,9 +79,21 @@ struct _WMEntry {
 	gboolean hidden;
 	DbusmenuMenuitem * mi;
 	WindowMenuDbusmenu * wm;
+	DbusmenuMenuitem * claim;
 	GVariant * vaccessible_desc;
+	GVariant * pending_label;
+	guint label_idle;
+	gint old_position;
+	/* Activated before its submenu was filled, shown once it is */
+	gboolean popup_pending;
+	guint popup_timestamp;
 };
 
+/* Property names we care about, compared by quark */
+static GQuark prop_visible_quark = 0;
+static GQuark prop_enabled_quark = 0;
+static GQuark prop_label_quark = 0;
+
 #define WINDOW_MENU_DBUSMENU_GET_PRIVATE(o) \
 (G_TYPE_INSTANCE_GET_PRIVATE ((o), WINDOW_MENU_DBUSMENU_TYPE, WindowMenuDbusmenuPrivate))
 
@@ -68,10 +106,13 @@ static void item_activate           (DbusmenuClient * client, DbusmenuMenuitem *
 static void status_changed          (DbusmenuClient * client, GParamSpec * pspec, gpointer user_data);
 static void menu_entry_added        (DbusmenuMenuitem * root, DbusmenuMenuitem * newentry, guint position, gpointer user_data);
 static void menu_entry_removed      (DbusmenuMenuitem * root, DbusmenuMenuitem * oldentry, gpointer user_data);
+static void menu_entry_moved        (DbusmenuMenuitem * root, DbusmenuMenuitem * child, guint newpos, guint oldpos, gpointer user_data);
 static void menu_entry_realized     (DbusmenuMenuitem * newentry, gpointer user_data);
 static void menu_entry_realized_child_added (DbusmenuMenuitem * parent, DbusmenuMenuitem * child, guint position, gpointer user_data);
 static void menu_prop_changed       (DbusmenuMenuitem * item, const gchar * property, GVariant * value, gpointer user_data);
 static void menu_child_realized     (DbusmenuMenuitem * child, gpointer user_data);
+static void label_cancel            (WMEntry * wmentry);
+static void finish_diff             (WindowMenuDbusmenu * wm);
 static void props_cb (GObject * object, GAsyncResult * res, gpointer user_data);
 static GList *          get_entries      (WindowMenu * wm);
 static guint            get_location     (WindowMenu * wm, IndicatorObjectEntry * entry);
@@ -102,6 +143,10 @@ window_menu_dbusmenu_class_init (WindowMenuDbusmenuClass *klass)
 	menu_class->entry_restore = entry_restore;
 	menu_class->entry_activate = entry_activate;
 
+	prop_visible_quark = g_quark_from_static_string(DBUSMENU_MENUITEM_PROP_VISIBLE);
+	prop_enabled_quark = g_quark_from_static_string(DBUSMENU_MENUITEM_PROP_ENABLED);
+	prop_label_quark = g_quark_from_static_string(DBUSMENU_MENUITEM_PROP_LABEL);
+
 	return;
 }
 
@@ -117,7 +162,42 @@ window_menu_dbusmenu_init (WindowMenuDbusmenu *self)
 	priv->root = NULL;
 	priv->error_state = FALSE;
 
+	priv->update_tokens = UPDATE_BUCKET_SIZE;
+	priv->update_time = g_get_monotonic_time();
+	priv->resync_timer = 0;
+	priv->throttled = 0;
+	priv->throttled_reported = 0;
+
 	priv->entries = g_array_new(FALSE, FALSE, sizeof(WMEntry *));
+	priv->stale_entries = g_array_new(FALSE, FALSE, sizeof(WMEntry *));
+	priv->diff_pending = g_ptr_array_new();
+	priv->slab = entry_slab_new(sizeof(WMEntry));
+
+	return;
+}
+
+/* Swap the submenu of an entry, keeping our ref and the destroy
+   tracking in sync with it */
+static void
+entry_set_menu (IndicatorObjectEntry * entry, GtkMenu * menu)
+{
+	if (entry->menu == menu) {
+		return;
+	}
+
+	if (entry->menu != NULL) {
+		g_signal_handlers_disconnect_by_func(entry->menu, G_CALLBACK(gtk_widget_destroyed), &entry->menu);
+		g_object_unref(entry->menu);
+		entry->menu = NULL;
+	}
+
+	if (menu == NULL) {
+		return;
+	}
+
+	entry->menu = g_object_ref(menu);
+	gtk_menu_detach(entry->menu);
+	g_signal_connect(entry->menu, "destroy", G_CALLBACK(gtk_widget_destroyed), &entry->menu);
 
 	return;
 }
@@ -128,6 +208,8 @@ entry_free(IndicatorObjectEntry * entry)
 	g_return_if_fail(entry != NULL);
 	WMEntry * wmentry = (WMEntry *)entry;
 
+	label_cancel(wmentry);
+
 	if (wmentry->mi != NULL) {
 		g_signal_handlers_disconnect_by_func(wmentry->mi, G_CALLBACK(menu_prop_changed), &wmentry->ioentry);
 		g_object_unref(G_OBJECT(wmentry->mi));
@@ -148,13 +230,9 @@ entry_free(IndicatorObjectEntry * entry)
 		g_object_unref(entry->image);
 		entry->image = NULL;
 	}
-	if (entry->menu != NULL) {
-		g_signal_handlers_disconnect_by_func(entry->menu, G_CALLBACK(gtk_widget_destroyed), &entry->menu);
-		g_object_unref(entry->menu);
-		entry->menu = NULL;
-	}
+	entry_set_menu(entry, NULL);
 
-	g_free(entry);
+	entry_slab_free(WINDOW_MENU_DBUSMENU_GET_PRIVATE(wmentry->wm)->slab, wmentry);
 }
 
 static void
@@ -170,7 +248,21 @@ free_entries(GObject *object, gboolean should_signal)
 			entry = g_array_index(priv->entries, IndicatorObjectEntry *, 0);
 			g_array_remove_index(priv->entries, 0);
 			if (should_signal) {
-				g_signal_emit_by_name(object, WINDOW_MENU_SIGNAL_ENTRY_REMOVED, entry, TRUE);
+				window_menu_emit_entry_removed(WINDOW_MENU(object), entry);
+			}
+			entry_free(entry);
+		}
+	}
+
+	/* The host is still showing these if a root change is waiting
+	   on its items */
+	if (priv->stale_entries != NULL) {
+		while (priv->stale_entries->len > 0) {
+			IndicatorObjectEntry * entry;
+			entry = g_array_index(priv->stale_entries, IndicatorObjectEntry *, 0);
+			g_array_remove_index(priv->stale_entries, 0);
+			if (should_signal) {
+				window_menu_emit_entry_removed(WINDOW_MENU(object), entry);
 			}
 			entry_free(entry);
 		}
@@ -183,6 +275,14 @@ window_menu_dbusmenu_dispose (GObject *object)
 {
 	WindowMenuDbusmenuPrivate * priv = WINDOW_MENU_DBUSMENU_GET_PRIVATE(object);
 
+	/* Nobody to tell about a root change anymore */
+	priv->diffing = FALSE;
+	if (priv->diff_timer != 0) {
+		g_source_remove(priv->diff_timer);
+		priv->diff_timer = 0;
+	}
+	g_clear_pointer(&priv->diff_pending, g_ptr_array_unref);
+
 	free_entries(object, FALSE);
 
 	if (priv->entries != NULL) {
@@ -190,6 +290,11 @@ window_menu_dbusmenu_dispose (GObject *object)
 		priv->entries = NULL;
 	}
 
+	if (priv->stale_entries != NULL) {
+		g_array_free(priv->stale_entries, TRUE);
+		priv->stale_entries = NULL;
+	}
+
 	if (priv->root != NULL) {
 		root_changed(DBUSMENU_CLIENT(priv->client), NULL, object);
 		g_warn_if_fail(priv->root == NULL);
@@ -201,6 +306,8 @@ window_menu_dbusmenu_dispose (GObject *object)
 		priv->client = NULL;
 	}
 
+	g_clear_object(&priv->accel_group);
+
 	if (priv->props != NULL) {
 		g_object_unref(G_OBJECT(priv->props));
 		priv->props = NULL;
@@ -217,6 +324,20 @@ window_menu_dbusmenu_dispose (GObject *object)
 		priv->retry_timer = 0;
 	}
 
+	if (priv->resync_timer != 0) {
+		g_source_remove(priv->resync_timer);
+		priv->resync_timer = 0;
+	}
+
+	if (priv->slab != NULL) {
+		guint allocated, chunks;
+		entry_slab_get_stats(priv->slab, &allocated, NULL, &chunks);
+		g_debug("Window %d made %u entries in %u chunks", priv->windowid, allocated, chunks);
+
+		entry_slab_destroy(priv->slab);
+		priv->slab = NULL;
+	}
+
 	G_OBJECT_CLASS (window_menu_dbusmenu_parent_class)->dispose (object);
 	return;
 }
@@ -258,7 +379,7 @@ event_status (DbusmenuClient * client, DbusmenuMenuitem * mi, gchar * event, GVa
 	if (error == NULL) {
 		g_debug("Error state repaired");
 		priv->error_state = FALSE;
-		g_signal_emit_by_name(G_OBJECT(user_data), WINDOW_MENU_SIGNAL_ERROR_STATE, priv->error_state, TRUE);
+		window_menu_emit_error_state(WINDOW_MENU(user_data), priv->error_state);
 
 		for (i = 0; i < priv->entries->len; i++) {
 			IndicatorObjectEntry * entry = g_array_index(priv->entries, IndicatorObjectEntry *, i);
@@ -276,7 +397,7 @@ event_status (DbusmenuClient * client, DbusmenuMenuitem * mi, gchar * event, GVa
 	/* Uhg, means that events are breaking, now we need to
 	   try and handle that case. */
 	priv->error_state = TRUE;
-	g_signal_emit_by_name(G_OBJECT(user_data), WINDOW_MENU_SIGNAL_ERROR_STATE, priv->error_state, TRUE);
+	window_menu_emit_error_state(WINDOW_MENU(user_data), priv->error_state);
 
 	for (i = 0; i < priv->entries->len; i++) {
 		IndicatorObjectEntry * entry = g_array_index(priv->entries, IndicatorObjectEntry *, i);
@@ -335,7 +456,7 @@ item_activate (DbusmenuClient * client, DbusmenuMenuitem * item, guint timestamp
 		return;
 	}
 
-	g_signal_emit_by_name(G_OBJECT(user_data), WINDOW_MENU_SIGNAL_SHOW_MENU, entry, timestamp, TRUE);
+	window_menu_emit_show_menu(WINDOW_MENU(user_data), entry, timestamp);
 
 	return;
 }
@@ -345,7 +466,7 @@ item_activate (DbusmenuClient * client, DbusmenuMenuitem * item, guint timestamp
 static void
 status_changed (DbusmenuClient * client, GParamSpec * pspec, gpointer user_data)
 {
-	g_signal_emit_by_name(G_OBJECT(user_data), WINDOW_MENU_SIGNAL_STATUS_CHANGED, dbusmenu_client_get_status (client));
+	window_menu_emit_status_changed(WINDOW_MENU(user_data), dbusmenu_client_get_status (client));
 }
 
 WindowMenuStatus dbusmenu_status_table[] = {
@@ -362,10 +483,134 @@ get_status (WindowMenu * wm)
 	return dbusmenu_status_table[dbusmenu_client_get_status (DBUSMENU_CLIENT (priv->client))];
 }
 
+/* Find the image dbusmenu-gtk put in a menu item */
+static void
+find_image_cb (GtkWidget * widget, gpointer user_data)
+{
+	GtkImage ** image = (GtkImage **)user_data;
+
+	if (*image != NULL) {
+		return;
+	}
+
+	if (GTK_IS_IMAGE(widget)) {
+		*image = GTK_IMAGE(widget);
+	} else if (GTK_IS_CONTAINER(widget)) {
+		gtk_container_forall(GTK_CONTAINER(widget), find_image_cb, user_data);
+	}
+
+	return;
+}
+
+/* dbusmenu-gtk decodes icon data for each item on its own.  Point the
+   image at the copy in the icon cache so identical icons share one
+   pixbuf, or give the cache this one if it's the first. */
+static void
+item_icon_sync (DbusmenuGtkClient * client, DbusmenuMenuitem * mi)
+{
+	gsize length = 0;
+	const guchar * data = dbusmenu_menuitem_property_get_byte_array(mi, DBUSMENU_MENUITEM_PROP_ICON_DATA, &length);
+
+	if (data == NULL || length == 0) {
+		return;
+	}
+
+	GtkMenuItem * gmi = dbusmenu_gtkclient_menuitem_get(client, mi);
+	if (gmi == NULL) {
+		return;
+	}
+
+	GtkImage * image = NULL;
+	gtk_container_forall(GTK_CONTAINER(gmi), find_image_cb, &image);
+
+	if (image == NULL || gtk_image_get_storage_type(image) != GTK_IMAGE_PIXBUF) {
+		return;
+	}
+
+	GdkPixbuf * shared = icon_cache_lookup_data("dbusmenu-gtk", data, length);
+	if (shared == NULL) {
+		icon_cache_insert_data("dbusmenu-gtk", data, length, gtk_image_get_pixbuf(image));
+		return;
+	}
+
+	if (shared != gtk_image_get_pixbuf(image)) {
+		gtk_image_set_from_pixbuf(image, shared);
+	}
+
+	g_object_unref(shared);
+	return;
+}
+
+/* The shortcut is shown with the closure the application's group
+   already has for it, instead of dbusmenu-gtk adding one per item */
+static void
+item_shortcut_sync (WindowMenuDbusmenu * wm, DbusmenuMenuitem * mi)
+{
+	WindowMenuDbusmenuPrivate * priv = WINDOW_MENU_DBUSMENU_GET_PRIVATE(wm);
+	GtkMenuItem * gmi = dbusmenu_gtkclient_menuitem_get(priv->client, mi);
+
+	if (gmi == NULL) {
+		return;
+	}
+
+	guint key = 0;
+	GdkModifierType mods = 0;
+	dbusmenu_menuitem_property_get_shortcut(mi, &key, &mods);
+	window_menu_set_item_accel(priv->accel_group, GTK_WIDGET(gmi), key, mods);
+
+	return;
+}
+
+static void
+item_realized (DbusmenuMenuitem * mi, gpointer user_data)
+{
+	WindowMenuDbusmenu * wm = WINDOW_MENU_DBUSMENU(user_data);
+	WindowMenuDbusmenuPrivate * priv = WINDOW_MENU_DBUSMENU_GET_PRIVATE(wm);
+
+	/* Items still come and go while we're being disposed */
+	if (priv->client == NULL) {
+		return;
+	}
+
+	item_icon_sync(priv->client, mi);
+	item_shortcut_sync(wm, mi);
+	return;
+}
+
+static void
+item_property_changed (DbusmenuMenuitem * mi, gchar * property, GVariant * value, gpointer user_data)
+{
+	WindowMenuDbusmenu * wm = WINDOW_MENU_DBUSMENU(user_data);
+	WindowMenuDbusmenuPrivate * priv = WINDOW_MENU_DBUSMENU_GET_PRIVATE(wm);
+
+	if (priv->client == NULL) {
+		return;
+	}
+
+	if (g_strcmp0(property, DBUSMENU_MENUITEM_PROP_ICON_DATA) == 0) {
+		item_icon_sync(priv->client, mi);
+	} else if (g_strcmp0(property, DBUSMENU_MENUITEM_PROP_SHORTCUT) == 0 ||
+	           g_strcmp0(property, DBUSMENU_MENUITEM_PROP_LABEL) == 0) {
+		/* A new label can mean a new accel label widget */
+		item_shortcut_sync(wm, mi);
+	}
+
+	return;
+}
+
+/* Run after dbusmenu-gtk has built the item's widget */
+static void
+item_new (DbusmenuClient * client, DbusmenuMenuitem * mi, gpointer user_data)
+{
+	g_signal_connect_object(G_OBJECT(mi), DBUSMENU_MENUITEM_SIGNAL_REALIZED, G_CALLBACK(item_realized), user_data, G_CONNECT_AFTER);
+	g_signal_connect_object(G_OBJECT(mi), DBUSMENU_MENUITEM_SIGNAL_PROPERTY_CHANGED, G_CALLBACK(item_property_changed), user_data, G_CONNECT_AFTER);
+	return;
+}
+
 /* Build a new window menus object and attach to the signals to build
    up the representative menu. */
 WindowMenuDbusmenu *
-window_menu_dbusmenu_new (const guint windowid, const gchar * dbus_addr, const gchar * dbus_object)
+window_menu_dbusmenu_new (const guint windowid, const gchar * dbus_addr, const gchar * dbus_object, WindowMenuLayout layout)
 {
 	g_debug("Creating new windows menu: %X, %s, %s", windowid, dbus_addr, dbus_object);
 
@@ -377,6 +622,7 @@ window_menu_dbusmenu_new (const guint windowid, const gchar * dbus_addr, const g
 	WindowMenuDbusmenuPrivate * priv = WINDOW_MENU_DBUSMENU_GET_PRIVATE(newmenu);
 
 	priv->windowid = windowid;
+	priv->layout = layout;
 
 	/* Build the service proxy */
 	priv->props_cancel = g_cancellable_new();
@@ -391,13 +637,15 @@ window_menu_dbusmenu_new (const guint windowid, const gchar * dbus_addr, const g
 	                         props_cb,
 	                         newmenu);
 
+	/* Windows of one application come from the same connection, so
+	   they share its accelerators.  The client doesn't get the group,
+	   item_shortcut_sync() puts the shortcuts on the labels. */
 	priv->client = dbusmenu_gtkclient_new((gchar *)dbus_addr, (gchar *)dbus_object);
-	GtkAccelGroup * agroup = gtk_accel_group_new();
-	dbusmenu_gtkclient_set_accel_group(priv->client, agroup);
-	g_object_unref(agroup);
+	priv->accel_group = window_menu_get_accel_group(dbus_addr);
 
 	g_signal_connect(G_OBJECT(priv->client), DBUSMENU_GTKCLIENT_SIGNAL_ROOT_CHANGED, G_CALLBACK(root_changed),   newmenu);
 	g_signal_connect(G_OBJECT(priv->client), DBUSMENU_CLIENT_SIGNAL_EVENT_RESULT, G_CALLBACK(event_status), newmenu);
+	g_signal_connect(G_OBJECT(priv->client), DBUSMENU_CLIENT_SIGNAL_NEW_MENUITEM, G_CALLBACK(item_new), newmenu);
 	g_signal_connect(G_OBJECT(priv->client), DBUSMENU_CLIENT_SIGNAL_ITEM_ACTIVATE, G_CALLBACK(item_activate), newmenu);
 	g_signal_connect(G_OBJECT(priv->client), "notify::" DBUSMENU_CLIENT_PROP_STATUS, G_CALLBACK(status_changed), newmenu);
 
@@ -515,6 +763,398 @@ remove_menuitem_signals (DbusmenuMenuitem * mi, gpointer user_data)
 	return;
 }
 
+/* Move the current entries aside so that the items of the new root
+   can pick them back up instead of building everything again */
+static void
+retire_entries (WindowMenuDbusmenu * wm)
+{
+	WindowMenuDbusmenuPrivate * priv = WINDOW_MENU_DBUSMENU_GET_PRIVATE(wm);
+	guint i;
+
+	for (i = 0; i < priv->entries->len; i++) {
+		WMEntry * wmentry = g_array_index(priv->entries, WMEntry *, i);
+		wmentry->old_position = i;
+		g_array_append_val(priv->stale_entries, wmentry);
+	}
+
+	g_array_set_size(priv->entries, 0);
+
+	return;
+}
+
+/* Pair the retired entries up with the items of the new root.  IDs
+   go first over the whole root, so that a label match can't take an
+   entry that a later item has by ID. */
+static void
+claim_stale_entries (WindowMenuDbusmenu * wm, GList * children)
+{
+	WindowMenuDbusmenuPrivate * priv = WINDOW_MENU_DBUSMENU_GET_PRIVATE(wm);
+	GArray * unclaimed = g_array_new(FALSE, FALSE, sizeof(DbusmenuMenuitem *));
+	GList * l;
+	guint i;
+
+	for (l = children; l != NULL; l = g_list_next(l)) {
+		DbusmenuMenuitem * item = DBUSMENU_MENUITEM(l->data);
+		gint id = dbusmenu_menuitem_get_id(item);
+		gboolean found = FALSE;
+
+		for (i = 0; i < priv->stale_entries->len && !found; i++) {
+			WMEntry * wmentry = g_array_index(priv->stale_entries, WMEntry *, i);
+			if (wmentry->claim == NULL && dbusmenu_menuitem_get_id(wmentry->mi) == id) {
+				wmentry->claim = item;
+				found = TRUE;
+			}
+		}
+
+		if (!found) {
+			g_array_append_val(unclaimed, item);
+		}
+	}
+
+	for (i = 0; i < unclaimed->len; i++) {
+		DbusmenuMenuitem * item = g_array_index(unclaimed, DbusmenuMenuitem *, i);
+		const gchar * label = dbusmenu_menuitem_property_get(item, DBUSMENU_MENUITEM_PROP_LABEL);
+		guint j;
+
+		for (j = 0; j < priv->stale_entries->len && label != NULL; j++) {
+			WMEntry * wmentry = g_array_index(priv->stale_entries, WMEntry *, j);
+			if (wmentry->claim == NULL && g_strcmp0(wmentry->ioentry.accessible_desc, label) == 0) {
+				wmentry->claim = item;
+				break;
+			}
+		}
+	}
+
+	g_array_free(unclaimed, TRUE);
+	return;
+}
+
+/* Take the retired entry that was paired up with the item, if any,
+   out of the stale list */
+static WMEntry *
+take_stale_entry (WindowMenuDbusmenu * wm, DbusmenuMenuitem * item)
+{
+	WindowMenuDbusmenuPrivate * priv = WINDOW_MENU_DBUSMENU_GET_PRIVATE(wm);
+	guint i;
+
+	for (i = 0; i < priv->stale_entries->len; i++) {
+		WMEntry * wmentry = g_array_index(priv->stale_entries, WMEntry *, i);
+		if (wmentry->claim == item) {
+			g_array_remove_index(priv->stale_entries, i);
+			wmentry->claim = NULL;
+			return wmentry;
+		}
+	}
+
+	return NULL;
+}
+
+/* Where an item belongs in the entries array, counting the entries
+   whose items come before it in the root.  The entries are kept in
+   root order, leaving aside the item itself when it's the one moving,
+   so one walk over both lists together does it. */
+static guint
+entry_insert_index (WindowMenuDbusmenu * wm, DbusmenuMenuitem * item)
+{
+	WindowMenuDbusmenuPrivate * priv = WINDOW_MENU_DBUSMENU_GET_PRIVATE(wm);
+	GList * l;
+	guint index = 0;
+	guint i = 0;
+
+	for (l = dbusmenu_menuitem_get_children(priv->root); l != NULL && l->data != item; l = l->next) {
+		if (i < priv->entries->len && g_array_index(priv->entries, WMEntry *, i)->mi == item) {
+			i++;
+		}
+
+		if (i < priv->entries->len && g_array_index(priv->entries, WMEntry *, i)->mi == l->data) {
+			index++;
+			i++;
+		}
+	}
+
+	return index;
+}
+
+/* Shift an entry within the array and tell everyone about it */
+static void
+entry_move (WindowMenuDbusmenu * wm, guint from, guint to)
+{
+	WindowMenuDbusmenuPrivate * priv = WINDOW_MENU_DBUSMENU_GET_PRIVATE(wm);
+
+	if (from == to) {
+		return;
+	}
+
+	WMEntry * wmentry = g_array_index(priv->entries, WMEntry *, from);
+	g_array_remove_index(priv->entries, from);
+	g_array_insert_val(priv->entries, to, wmentry);
+
+	window_menu_emit_entry_moved(WINDOW_MENU(wm), &wmentry->ioentry, from, to);
+	return;
+}
+
+/* Set the visibility and sensitivity of the entry from its item */
+static void
+entry_sync_state (WMEntry * wmentry)
+{
+	IndicatorObjectEntry * entry = &wmentry->ioentry;
+	DbusmenuMenuitem * mi = wmentry->mi;
+
+	if (dbusmenu_menuitem_property_get_variant(mi, DBUSMENU_MENUITEM_PROP_VISIBLE) != NULL
+		&& dbusmenu_menuitem_property_get_bool(mi, DBUSMENU_MENUITEM_PROP_VISIBLE) == FALSE) {
+		gtk_widget_hide(GTK_WIDGET(entry->label));
+		wmentry->hidden = TRUE;
+	} else {
+		gtk_widget_show(GTK_WIDGET(entry->label));
+		wmentry->hidden = FALSE;
+	}
+
+	if (dbusmenu_menuitem_property_get_variant (mi, DBUSMENU_MENUITEM_PROP_ENABLED) != NULL) {
+		gboolean sensitive = dbusmenu_menuitem_property_get_bool(mi, DBUSMENU_MENUITEM_PROP_ENABLED);
+		gtk_widget_set_sensitive(GTK_WIDGET(entry->label), sensitive);
+		wmentry->disabled = !sensitive;
+	}
+
+	return;
+}
+
+/* Point a retired entry at the matching item of the new root.  The
+   label and the accessible description are kept unless they changed. */
+static void
+entry_reuse (WindowMenuDbusmenu * wm, WMEntry * wmentry, DbusmenuMenuitem * newentry)
+{
+	WindowMenuDbusmenuPrivate * priv = WINDOW_MENU_DBUSMENU_GET_PRIVATE(wm);
+	IndicatorObjectEntry * entry = &wmentry->ioentry;
+
+	g_signal_handlers_disconnect_by_func(wmentry->mi, G_CALLBACK(menu_prop_changed), entry);
+	label_cancel(wmentry);
+	wmentry->popup_pending = FALSE;
+
+	if (wmentry->mi != newentry) {
+		g_object_unref(G_OBJECT(wmentry->mi));
+		wmentry->mi = newentry;
+		g_object_ref(G_OBJECT(wmentry->mi));
+	}
+
+	GVariant * label = dbusmenu_menuitem_property_get_variant(newentry, DBUSMENU_MENUITEM_PROP_LABEL);
+	if (label != NULL && (wmentry->vaccessible_desc == NULL || !g_variant_equal(label, wmentry->vaccessible_desc))) {
+		gtk_label_set_text_with_mnemonic(entry->label, g_variant_get_string(label, NULL));
+		g_clear_pointer(&wmentry->vaccessible_desc, g_variant_unref);
+		wmentry->vaccessible_desc = g_variant_ref(label);
+		entry->accessible_desc = g_variant_get_string(wmentry->vaccessible_desc, NULL);
+
+		window_menu_emit_a11y_update(WINDOW_MENU(wm), entry);
+	}
+
+	entry_set_menu(entry, dbusmenu_gtkclient_menuitem_get_submenu(priv->client, newentry));
+
+	return;
+}
+
+/* Where an entry is in the host's idea of our entries */
+static guint
+view_index (GArray * view, WMEntry * wmentry)
+{
+	guint i;
+
+	for (i = 0; i < view->len; i++) {
+		if (g_array_index(view, WMEntry *, i) == wmentry) {
+			break;
+		}
+	}
+
+	return i;
+}
+
+/* Tell the host how to get from the entries it is showing to the
+   ones of the new root.  Retired entries nobody took are removed.
+   Reused entries that kept their relative order, the longest such
+   run, stay where they are.  Everything else is added or moved into
+   place one at a time, with positions worked out on a copy of what
+   the host has at that point. */
+static void
+finish_diff (WindowMenuDbusmenu * wm)
+{
+	WindowMenuDbusmenuPrivate * priv = WINDOW_MENU_DBUSMENU_GET_PRIVATE(wm);
+	guint len = priv->entries->len;
+	guint shown = 0;
+	guint i, j;
+
+	priv->diffing = FALSE;
+	g_ptr_array_set_size(priv->diff_pending, 0);
+
+	if (priv->diff_timer != 0) {
+		g_source_remove(priv->diff_timer);
+		priv->diff_timer = 0;
+	}
+
+	/* The host has the retired entries in their old order */
+	for (i = 0; i < len; i++) {
+		if (g_array_index(priv->entries, WMEntry *, i)->old_position >= 0) {
+			shown++;
+		}
+	}
+	shown += priv->stale_entries->len;
+
+	GArray * view = g_array_sized_new(FALSE, FALSE, sizeof(WMEntry *), shown + len);
+	g_array_set_size(view, shown);
+
+	for (i = 0; i < len; i++) {
+		WMEntry * wmentry = g_array_index(priv->entries, WMEntry *, i);
+		if (wmentry->old_position >= 0) {
+			g_array_index(view, WMEntry *, wmentry->old_position) = wmentry;
+		}
+	}
+	for (i = 0; i < priv->stale_entries->len; i++) {
+		WMEntry * wmentry = g_array_index(priv->stale_entries, WMEntry *, i);
+		g_array_index(view, WMEntry *, wmentry->old_position) = wmentry;
+	}
+
+	while (priv->stale_entries->len > 0) {
+		WMEntry * wmentry = g_array_index(priv->stale_entries, WMEntry *, 0);
+		g_array_remove_index(priv->stale_entries, 0);
+		g_array_remove_index(view, view_index(view, wmentry));
+		window_menu_emit_entry_removed(WINDOW_MENU(wm), &wmentry->ioentry);
+		entry_free(&wmentry->ioentry);
+	}
+
+	guint * run = g_new0(guint, len + 1);
+	gint * prev = g_new(gint, len + 1);
+	gboolean * keep = g_new0(gboolean, len + 1);
+	gint best = -1;
+
+	for (i = 0; i < len; i++) {
+		WMEntry * wmentry = g_array_index(priv->entries, WMEntry *, i);
+		prev[i] = -1;
+
+		if (wmentry->old_position < 0) {
+			continue;
+		}
+
+		run[i] = 1;
+		for (j = 0; j < i; j++) {
+			WMEntry * before = g_array_index(priv->entries, WMEntry *, j);
+			if (before->old_position >= 0 && before->old_position < wmentry->old_position && run[j] + 1 > run[i]) {
+				run[i] = run[j] + 1;
+				prev[i] = j;
+			}
+		}
+
+		if (best < 0 || run[i] > run[best]) {
+			best = i;
+		}
+	}
+
+	for (; best >= 0; best = prev[best]) {
+		keep[best] = TRUE;
+	}
+
+	/* Each entry goes right after the one before it in the new
+	   order, which is already in place by the time we get to it */
+	for (i = 0; i < len; i++) {
+		WMEntry * wmentry = g_array_index(priv->entries, WMEntry *, i);
+
+		if (!keep[i]) {
+			if (wmentry->old_position < 0) {
+				/* Added entries go on the end */
+				window_menu_emit_entry_added(WINDOW_MENU(wm), &wmentry->ioentry);
+				g_array_append_val(view, wmentry);
+			}
+
+			guint from = view_index(view, wmentry);
+			g_array_remove_index(view, from);
+
+			guint to = 0;
+			if (i > 0) {
+				to = view_index(view, g_array_index(priv->entries, WMEntry *, i - 1)) + 1;
+			}
+			g_array_insert_val(view, to, wmentry);
+
+			if (from != to) {
+				window_menu_emit_entry_moved(WINDOW_MENU(wm), &wmentry->ioentry, from, to);
+			}
+		}
+	}
+
+	for (i = 0; i < len; i++) {
+		g_array_index(priv->entries, WMEntry *, i)->old_position = -1;
+	}
+
+	g_array_free(view, TRUE);
+	g_free(keep);
+	g_free(prev);
+	g_free(run);
+
+	return;
+}
+
+/* Some items of the new root never got realized, go with what we
+   have.  The rest get added when they turn up. */
+static gboolean
+diff_timeout (gpointer user_data)
+{
+	WindowMenuDbusmenu * wm = WINDOW_MENU_DBUSMENU(user_data);
+	WindowMenuDbusmenuPrivate * priv = WINDOW_MENU_DBUSMENU_GET_PRIVATE(wm);
+
+	priv->diff_timer = 0;
+	g_debug("Items of window %d still not realized, finishing the root change without them", priv->windowid);
+	finish_diff(wm);
+
+	return FALSE;
+}
+
+/* Rebuild from the root after we've dropped updates */
+static gboolean
+resync_timeout (gpointer user_data)
+{
+	WindowMenuDbusmenu * wm = WINDOW_MENU_DBUSMENU(user_data);
+	WindowMenuDbusmenuPrivate * priv = WINDOW_MENU_DBUSMENU_GET_PRIVATE(wm);
+
+	priv->resync_timer = 0;
+
+	g_debug("Resyncing menus for window %d, %u updates throttled, %u since it was created",
+	        priv->windowid, priv->throttled - priv->throttled_reported, priv->throttled);
+	priv->throttled_reported = priv->throttled;
+
+	if (priv->root != NULL) {
+		DbusmenuMenuitem * root = priv->root;
+		g_object_ref(root);
+		root_changed(DBUSMENU_CLIENT(priv->client), root, wm);
+		g_object_unref(root);
+	}
+
+	return FALSE;
+}
+
+/* Take a token for an update from the client.  If there isn't one
+   the caller drops the update and we resync once things calm down. */
+static gboolean
+update_allowed (WindowMenuDbusmenu * wm)
+{
+	WindowMenuDbusmenuPrivate * priv = WINDOW_MENU_DBUSMENU_GET_PRIVATE(wm);
+	gint64 now = g_get_monotonic_time();
+
+	priv->update_tokens += (now - priv->update_time) * UPDATE_REFILL_RATE / G_USEC_PER_SEC;
+	priv->update_tokens = MIN(priv->update_tokens, UPDATE_BUCKET_SIZE);
+	priv->update_time = now;
+
+	if (priv->resync_timer == 0 && priv->update_tokens >= 1.0) {
+		priv->update_tokens -= 1.0;
+		return TRUE;
+	}
+
+	/* Everything waits for the resync once one is pending, otherwise
+	   we could apply updates out of order */
+	priv->throttled++;
+
+	if (priv->resync_timer == 0) {
+		g_debug("Throttling menu updates for window %d", priv->windowid);
+		priv->resync_timer = g_timeout_add(UPDATE_RESYNC_DELAY, resync_timeout, wm);
+	}
+
+	return FALSE;
+}
+
 /* Respond to the root menu item on our client changing */
 static void
 root_changed (DbusmenuClient * client, DbusmenuMenuitem * new_root, gpointer user_data)
@@ -522,8 +1162,18 @@ root_changed (DbusmenuClient * client, DbusmenuMenuitem * new_root, gpointer use
 	g_return_if_fail(IS_WINDOW_MENU_DBUSMENU(user_data));
 	WindowMenuDbusmenuPrivate * priv = WINDOW_MENU_DBUSMENU_GET_PRIVATE(user_data);
 
-	/* Remove the old entries */
-	free_entries(G_OBJECT(user_data), TRUE);
+	/* Bring the host up to date with the last change first */
+	if (priv->diffing) {
+		finish_diff(WINDOW_MENU_DBUSMENU(user_data));
+	}
+
+	/* Keep the old entries for the new root to reuse, or remove
+	   them if there won't be one */
+	if (new_root != NULL) {
+		retire_entries(WINDOW_MENU_DBUSMENU(user_data));
+	} else {
+		free_entries(G_OBJECT(user_data), TRUE);
+	}
 
 	if (priv->root != NULL) {
 		dbusmenu_menuitem_foreach(priv->root, remove_menuitem_signals, user_data);
@@ -543,13 +1193,31 @@ root_changed (DbusmenuClient * client, DbusmenuMenuitem * new_root, gpointer use
 	/* Set up signals */
 	g_signal_connect(G_OBJECT(new_root), DBUSMENU_MENUITEM_SIGNAL_CHILD_ADDED,   G_CALLBACK(menu_entry_added),   user_data);
 	g_signal_connect(G_OBJECT(new_root), DBUSMENU_MENUITEM_SIGNAL_CHILD_REMOVED, G_CALLBACK(menu_entry_removed), user_data);
-	/* TODO: Child Moved */
+	g_signal_connect(G_OBJECT(new_root), DBUSMENU_MENUITEM_SIGNAL_CHILD_MOVED,   G_CALLBACK(menu_entry_moved),   user_data);
+
+	/* Add the new entries.  The host hears about them once every
+	   item has been realized and has its entry. */
+	priv->diffing = TRUE;
 
-	/* Add the new entries */
 	GList * children = dbusmenu_menuitem_get_children(new_root);
-	while (children != NULL) {
-		new_root_helper(DBUSMENU_MENUITEM(children->data), user_data);
-		children = g_list_next(children);
+	GList * l;
+
+	claim_stale_entries(WINDOW_MENU_DBUSMENU(user_data), children);
+
+	for (l = children; l != NULL; l = g_list_next(l)) {
+		g_ptr_array_add(priv->diff_pending, l->data);
+	}
+
+	for (l = children; l != NULL; l = g_list_next(l)) {
+		new_root_helper(DBUSMENU_MENUITEM(l->data), user_data);
+	}
+
+	if (priv->diffing) {
+		if (priv->diff_pending->len == 0) {
+			finish_diff(WINDOW_MENU_DBUSMENU(user_data));
+		} else {
+			priv->diff_timer = g_timeout_add(DIFF_REALIZE_TIMEOUT, diff_timeout, user_data);
+		}
 	}
 
 	return;
@@ -562,6 +1230,12 @@ menu_entry_added (DbusmenuMenuitem * root, DbusmenuMenuitem * newentry, guint po
 	g_return_if_fail(IS_WINDOW_MENU_DBUSMENU(user_data));
 	WindowMenuDbusmenuPrivate * priv = WINDOW_MENU_DBUSMENU_GET_PRIVATE(user_data);
 
+	/* Walking a new root is how we catch up, dropping items there
+	   would lose them and ask for yet another resync */
+	if (!priv->diffing && !update_allowed(WINDOW_MENU_DBUSMENU(user_data))) {
+		return;
+	}
+
 	g_signal_connect(G_OBJECT(newentry), DBUSMENU_MENUITEM_SIGNAL_REALIZED, G_CALLBACK(menu_entry_realized), user_data);
 
 	GtkMenuItem * mi = dbusmenu_gtkclient_menuitem_get(priv->client, newentry);
@@ -607,9 +1281,11 @@ menu_entry_realized (DbusmenuMenuitem * newentry, gpointer user_data)
 	GtkMenu * menu = dbusmenu_gtkclient_menuitem_get_submenu(priv->client, newentry);
 
 	/* Check to see if we have any children, if we don't let's see if
-	   we can scare some up for fun. */
+	   we can scare some up for fun.  On demand that waits until the
+	   entry gets activated. */
 	GList * children = dbusmenu_menuitem_get_children(newentry);
-	if (children == NULL && g_strcmp0(DBUSMENU_MENUITEM_CHILD_DISPLAY_SUBMENU, dbusmenu_menuitem_property_get(newentry, DBUSMENU_MENUITEM_PROP_CHILD_DISPLAY)) == 0) {
+	if (children == NULL && priv->layout == WINDOW_MENU_LAYOUT_FULL &&
+	    g_strcmp0(DBUSMENU_MENUITEM_CHILD_DISPLAY_SUBMENU, dbusmenu_menuitem_property_get(newentry, DBUSMENU_MENUITEM_PROP_CHILD_DISPLAY)) == 0) {
 		dbusmenu_menuitem_send_about_to_show(newentry, NULL, NULL);
 	}
 
@@ -644,35 +1320,116 @@ menu_entry_realized (DbusmenuMenuitem * newentry, gpointer user_data)
 	return;
 }
 
+/* Drop a label update that hasn't been applied yet */
+static void
+label_cancel (WMEntry * wmentry)
+{
+	if (wmentry->label_idle != 0) {
+		g_source_remove(wmentry->label_idle);
+		wmentry->label_idle = 0;
+	}
+
+	g_clear_pointer(&wmentry->pending_label, g_variant_unref);
+
+	return;
+}
+
+/* Apply the last label we were sent since the previous frame */
+static gboolean
+label_idle_cb (gpointer user_data)
+{
+	WMEntry * wmentry = (WMEntry *)user_data;
+	IndicatorObjectEntry * entry = &wmentry->ioentry;
+
+	wmentry->label_idle = 0;
+
+	GVariant * label = wmentry->pending_label;
+	wmentry->pending_label = NULL;
+
+	if (label == NULL) {
+		return FALSE;
+	}
+
+	if (wmentry->vaccessible_desc != NULL && g_variant_equal(label, wmentry->vaccessible_desc)) {
+		/* It went back to what's showing */
+		g_variant_unref(label);
+		return FALSE;
+	}
+
+	gtk_label_set_text_with_mnemonic(entry->label, g_variant_get_string(label, NULL));
+	g_clear_pointer(&wmentry->vaccessible_desc, g_variant_unref);
+	wmentry->vaccessible_desc = label;
+	entry->accessible_desc = g_variant_get_string(label, NULL);
+
+	if (wmentry->wm != NULL) {
+		window_menu_emit_a11y_update(WINDOW_MENU(wmentry->wm), entry);
+	}
+
+	return FALSE;
+}
+
 /* Respond to properties changing on the menu item so that we can
-   properly hide and show them. */
+   properly hide and show them.  Label changes are batched up so
+   that an app retitling constantly only costs one update a frame. */
 static void
 menu_prop_changed (DbusmenuMenuitem * item, const gchar * property, GVariant * value, gpointer user_data)
 {
 	IndicatorObjectEntry * entry = (IndicatorObjectEntry *)user_data;
 	WMEntry * wmentry = (WMEntry *)user_data;
+	GQuark prop = g_quark_try_string(property);
 
-	if (!g_strcmp0(property, DBUSMENU_MENUITEM_PROP_VISIBLE)) {
-		if (g_variant_get_boolean(value)) {
-			gtk_widget_show(GTK_WIDGET(entry->label));
-			wmentry->hidden = FALSE;
-		} else {
+	if (prop == 0) {
+		return;
+	}
+
+	if (prop == prop_visible_quark) {
+		gboolean hidden = (value != NULL && !g_variant_get_boolean(value));
+		if (hidden == wmentry->hidden) {
+			return;
+		}
+
+		if (wmentry->wm != NULL && !update_allowed(wmentry->wm)) {
+			return;
+		}
+
+		if (hidden) {
 			gtk_widget_hide(GTK_WIDGET(entry->label));
-			wmentry->hidden = TRUE;
-		}
-	} else if (!g_strcmp0(property, DBUSMENU_MENUITEM_PROP_ENABLED)) {
-		gtk_widget_set_sensitive(GTK_WIDGET(entry->label), g_variant_get_boolean(value));
-		wmentry->disabled = !g_variant_get_boolean(value);
-	} else if (!g_strcmp0(property, DBUSMENU_MENUITEM_PROP_LABEL)) {
-		const gchar* str = g_variant_get_string(value, NULL);
-		if(str != NULL)
-			gtk_label_set_text_with_mnemonic(entry->label, str);
-		g_clear_pointer(&wmentry->vaccessible_desc, g_variant_unref);
-		entry->accessible_desc = g_variant_get_string(value, NULL);
-		wmentry->vaccessible_desc = g_variant_ref(value);
+		} else {
+			gtk_widget_show(GTK_WIDGET(entry->label));
+		}
+		wmentry->hidden = hidden;
+	} else if (prop == prop_enabled_quark) {
+		gboolean disabled = (value != NULL && !g_variant_get_boolean(value));
+		if (disabled == wmentry->disabled) {
+			return;
+		}
+
+		if (wmentry->wm != NULL && !update_allowed(wmentry->wm)) {
+			return;
+		}
+
+		gtk_widget_set_sensitive(GTK_WIDGET(entry->label), !disabled);
+		wmentry->disabled = disabled;
+	} else if (prop == prop_label_quark) {
+		if (value == NULL) {
+			return;
+		}
+
+		/* Compare with whatever will be showing after the next frame */
+		GVariant * current = wmentry->pending_label != NULL ? wmentry->pending_label : wmentry->vaccessible_desc;
+		if (current != NULL && g_variant_equal(value, current)) {
+			return;
+		}
 
-		if (wmentry->wm != NULL) {
-			g_signal_emit_by_name(G_OBJECT(wmentry->wm), WINDOW_MENU_SIGNAL_A11Y_UPDATE, entry, TRUE);
+		if (wmentry->wm != NULL && !update_allowed(wmentry->wm)) {
+			return;
+		}
+
+		g_clear_pointer(&wmentry->pending_label, g_variant_unref);
+		wmentry->pending_label = g_variant_ref(value);
+
+		if (wmentry->label_idle == 0) {
+			wmentry->label_idle = g_idle_add_full(G_PRIORITY_HIGH_IDLE + 10, label_idle_cb, wmentry, NULL);
 		}
 	}
 
@@ -702,68 +1459,123 @@ menu_child_realized (DbusmenuMenuitem * child, gpointer user_data)
 	}
 
 	WindowMenuDbusmenuPrivate * priv = WINDOW_MENU_DBUSMENU_GET_PRIVATE(wm);
-	WMEntry * wmentry = g_new0(WMEntry, 1);
-	wmentry->wm = wm;
-	IndicatorObjectEntry * entry = &wmentry->ioentry;
-	entry->parent_window = priv->windowid;
+	IndicatorObjectEntry * entry = get_entry(wm, newentry, NULL);
 
-	wmentry->mi = newentry;
-	g_object_ref(G_OBJECT(wmentry->mi));
-
-	entry->label = GTK_LABEL(gtk_label_new_with_mnemonic(dbusmenu_menuitem_property_get(newentry, DBUSMENU_MENUITEM_PROP_LABEL)));
+	if (entry != NULL) {
+		/* We already have an entry for this item, it's just gotten
+		   its children late.  Pick up the submenu. */
+		WMEntry * wmentry = (WMEntry *)entry;
+		entry_set_menu(entry, dbusmenu_gtkclient_menuitem_get_submenu(priv->client, newentry));
+
+		if (wmentry->popup_pending && entry->menu != NULL) {
+			wmentry->popup_pending = FALSE;
+			window_menu_emit_show_menu(WINDOW_MENU(wm), entry, wmentry->popup_timestamp);
+		}
 
-	if (entry->label != NULL) {
-		g_object_ref_sink(entry->label);
+		g_object_unref(newentry);
+		return;
 	}
 
-	g_clear_pointer(&wmentry->vaccessible_desc, g_variant_unref);
-	wmentry->vaccessible_desc = g_variant_ref(dbusmenu_menuitem_property_get_variant(newentry, DBUSMENU_MENUITEM_PROP_LABEL));
-	entry->accessible_desc = g_variant_get_string(wmentry->vaccessible_desc, NULL);
-
-	entry->menu = dbusmenu_gtkclient_menuitem_get_submenu(priv->client, newentry);
+	WMEntry * wmentry = take_stale_entry(wm, newentry);
 
-	if (entry->menu == NULL) {
-		g_debug("Submenu for %s is NULL", dbusmenu_menuitem_property_get(newentry, DBUSMENU_MENUITEM_PROP_LABEL));
+	if (wmentry != NULL) {
+		entry = &wmentry->ioentry;
+		entry_reuse(wm, wmentry, newentry);
 	} else {
-		g_object_ref(entry->menu);
-		gtk_menu_detach(entry->menu);
-		g_signal_connect(entry->menu, "destroy", G_CALLBACK(gtk_widget_destroyed), &entry->menu);
+		wmentry = entry_slab_alloc(priv->slab);
+		wmentry->wm = wm;
+		wmentry->old_position = -1;
+		entry = &wmentry->ioentry;
+		entry->parent_window = priv->windowid;
+
+		wmentry->mi = newentry;
+		g_object_ref(G_OBJECT(wmentry->mi));
+
+		entry->label = GTK_LABEL(gtk_label_new_with_mnemonic(dbusmenu_menuitem_property_get(newentry, DBUSMENU_MENUITEM_PROP_LABEL)));
+
+		if (entry->label != NULL) {
+			g_object_ref_sink(entry->label);
+		}
+
+		g_clear_pointer(&wmentry->vaccessible_desc, g_variant_unref);
+		wmentry->vaccessible_desc = g_variant_ref(dbusmenu_menuitem_property_get_variant(newentry, DBUSMENU_MENUITEM_PROP_LABEL));
+		entry->accessible_desc = g_variant_get_string(wmentry->vaccessible_desc, NULL);
+
+		entry_set_menu(entry, dbusmenu_gtkclient_menuitem_get_submenu(priv->client, newentry));
+
+		if (entry->menu == NULL) {
+			g_debug("Submenu for %s is NULL", dbusmenu_menuitem_property_get(newentry, DBUSMENU_MENUITEM_PROP_LABEL));
+		}
 	}
 
 	g_signal_connect(G_OBJECT(newentry), DBUSMENU_MENUITEM_SIGNAL_PROPERTY_CHANGED, G_CALLBACK(menu_prop_changed), entry);
 
-	if (dbusmenu_menuitem_property_get_variant(newentry, DBUSMENU_MENUITEM_PROP_VISIBLE) != NULL
-		&& dbusmenu_menuitem_property_get_bool(newentry, DBUSMENU_MENUITEM_PROP_VISIBLE) == FALSE) {
-		gtk_widget_hide(GTK_WIDGET(entry->label));
-		wmentry->hidden = TRUE;
-	} else {
-		gtk_widget_show(GTK_WIDGET(entry->label));
-		wmentry->hidden = FALSE;
-	}
+	entry_sync_state(wmentry);
 
-	if (dbusmenu_menuitem_property_get_variant (newentry, DBUSMENU_MENUITEM_PROP_ENABLED) != NULL) {
-		gboolean sensitive = dbusmenu_menuitem_property_get_bool(newentry, DBUSMENU_MENUITEM_PROP_ENABLED);
-		gtk_widget_set_sensitive(GTK_WIDGET(entry->label), sensitive);
-		wmentry->disabled = !sensitive;
+	if (priv->diffing) {
+		/* The signals go out once the whole root has been compared */
+		guint index = entry_insert_index(wm, newentry);
+		g_array_insert_val(priv->entries, index, wmentry);
+
+		if (g_ptr_array_remove(priv->diff_pending, newentry) && priv->diff_pending->len == 0) {
+			finish_diff(wm);
+		}
+
+		g_object_unref(newentry);
+		return;
 	}
 
-	g_array_append_val(priv->entries, wmentry);
+	guint index = entry_insert_index(wm, newentry);
 
-	g_signal_emit_by_name(G_OBJECT(wm), WINDOW_MENU_SIGNAL_ENTRY_ADDED, entry, TRUE);
+	/* Our entry added signals that we pass up don't have position
+	   information, so the entry goes on the end and then gets moved
+	   into place if it was inserted in the middle */
+	g_array_append_val(priv->entries, wmentry);
+	window_menu_emit_entry_added(WINDOW_MENU(wm), entry);
+	entry_move(wm, priv->entries->len - 1, index);
 
 	g_object_unref(newentry);
 
-	guint pos = dbusmenu_menuitem_get_position (newentry,
-	                                            dbusmenu_menuitem_get_parent (newentry));
-	if (pos < priv->entries->len - 1) {
-		/* Our entry added signals that we pass up don't have position
-		   information, so we can only add to the end of the list of
-		   entries.  So when we get an inserted-in-the-middle entry,
-		   we fake a root change to remove all entries and add them
-		   back up again */
-		g_object_ref(priv->root);
-		root_changed(DBUSMENU_CLIENT(priv->client), priv->root, wm);
-		g_object_unref(priv->root);
+	return;
+}
+
+/* An item of the new root went away before the host was told about
+   the root change.  Entries the host has are left for finish_diff()
+   to remove, ones it never saw just go. */
+static void
+diff_remove_item (WindowMenuDbusmenu * wm, DbusmenuMenuitem * item)
+{
+	WindowMenuDbusmenuPrivate * priv = WINDOW_MENU_DBUSMENU_GET_PRIVATE(wm);
+	guint i;
+
+	g_ptr_array_remove(priv->diff_pending, item);
+
+	for (i = 0; i < priv->stale_entries->len; i++) {
+		WMEntry * wmentry = g_array_index(priv->stale_entries, WMEntry *, i);
+		if (wmentry->claim == item) {
+			wmentry->claim = NULL;
+		}
+	}
+
+	guint position;
+	IndicatorObjectEntry * entry = get_entry(wm, item, &position);
+
+	if (entry != NULL) {
+		WMEntry * wmentry = (WMEntry *)entry;
+		g_array_remove_index(priv->entries, position);
+
+		if (wmentry->old_position >= 0) {
+			g_array_append_val(priv->stale_entries, wmentry);
+		} else {
+			entry_free(entry);
+		}
+	} else {
+		g_signal_handlers_disconnect_by_func(G_OBJECT(item), G_CALLBACK(menu_entry_realized), wm);
+		g_signal_handlers_disconnect_by_func(G_OBJECT(item), G_CALLBACK(menu_entry_realized_child_added), wm);
+	}
+
+	if (priv->diff_pending->len == 0) {
+		finish_diff(wm);
 	}
 
 	return;
@@ -777,6 +1589,11 @@ menu_entry_removed (DbusmenuMenuitem * root, DbusmenuMenuitem * oldentry, gpoint
 	g_return_if_fail(DBUSMENU_IS_MENUITEM(oldentry));
 	WindowMenuDbusmenuPrivate * priv = WINDOW_MENU_DBUSMENU_GET_PRIVATE(user_data);
 
+	if (priv->diffing) {
+		diff_remove_item(WINDOW_MENU_DBUSMENU(user_data), oldentry);
+		return;
+	}
+
 	if (priv->entries == NULL || priv->entries->len == 0) {
 		return;
 	}
@@ -786,7 +1603,7 @@ menu_entry_removed (DbusmenuMenuitem * root, DbusmenuMenuitem * oldentry, gpoint
 
 	if (entry != NULL) {
 		g_array_remove_index(priv->entries, position);
-		g_signal_emit_by_name(G_OBJECT(user_data), WINDOW_MENU_SIGNAL_ENTRY_REMOVED, entry, TRUE);
+		window_menu_emit_entry_removed(WINDOW_MENU(user_data), entry);
 		entry_free(entry);
 	} else {
 		/* We've been called before menu_child_realized fired,
@@ -799,6 +1616,46 @@ menu_entry_removed (DbusmenuMenuitem * root, DbusmenuMenuitem * oldentry, gpoint
 	return;
 }
 
+/* Respond to an entry getting moved in the menu */
+static void
+menu_entry_moved (DbusmenuMenuitem * root, DbusmenuMenuitem * child, guint newpos, guint oldpos, gpointer user_data)
+{
+	g_return_if_fail(IS_WINDOW_MENU_DBUSMENU(user_data));
+	g_return_if_fail(DBUSMENU_IS_MENUITEM(child));
+	WindowMenuDbusmenu * wm = WINDOW_MENU_DBUSMENU(user_data);
+	WindowMenuDbusmenuPrivate * priv = WINDOW_MENU_DBUSMENU_GET_PRIVATE(wm);
+
+	/* Moves while diffing are part of taking in the new root */
+	if (!priv->diffing && !update_allowed(wm)) {
+		return;
+	}
+
+	guint from;
+	IndicatorObjectEntry * entry = get_entry(wm, child, &from);
+
+	if (entry == NULL) {
+		/* Not realized yet, it'll get put in the right place
+		   when it is */
+		return;
+	}
+
+	/* The host hasn't seen the new order yet, finish_diff() works
+	   out the moves from wherever the entries end up */
+	if (priv->diffing) {
+		WMEntry * wmentry = g_array_index(priv->entries, WMEntry *, from);
+		g_array_remove_index(priv->entries, from);
+		guint to = entry_insert_index(wm, child);
+		g_array_insert_val(priv->entries, to, wmentry);
+		return;
+	}
+
+	/* The entry never counts itself, so this is the slot it
+	   belongs in once it's been taken out */
+	entry_move(wm, from, entry_insert_index(wm, child));
+
+	return;
+}
+
 /* Get the XID of this window */
 static guint
 get_xid (WindowMenu * wm)
@@ -883,9 +1740,17 @@ entry_activate (WindowMenu * wm, IndicatorObjectEntry * entry, guint timestamp)
 	g_return_if_fail(IS_WINDOW_MENU_DBUSMENU(wm));
 	g_return_if_fail(entry != NULL);
 	WMEntry * wme = (WMEntry *)entry;
+	WindowMenuDbusmenuPrivate * priv = WINDOW_MENU_DBUSMENU_GET_PRIVATE(wm);
 
+	/* On demand a submenu that hasn't been filled yet only needs
+	   asking, and gets shown once its children arrive */
+	if (entry->menu == NULL && priv->layout == WINDOW_MENU_LAYOUT_ON_DEMAND &&
+	    g_strcmp0(DBUSMENU_MENUITEM_CHILD_DISPLAY_SUBMENU, dbusmenu_menuitem_property_get(wme->mi, DBUSMENU_MENUITEM_PROP_CHILD_DISPLAY)) == 0) {
+		wme->popup_pending = TRUE;
+		wme->popup_timestamp = timestamp;
+		dbusmenu_menuitem_send_about_to_show(wme->mi, NULL, NULL);
 	/* If entry is a childless menu item, activate the entry. */
-	if (entry->menu == NULL) {
+	} else if (entry->menu == NULL) {
 		dbusmenu_menuitem_handle_event(wme->mi,
 		                               DBUSMENU_MENUITEM_EVENT_ACTIVATED,
 		                               NULL,
@@ -21,30 +21,87 @@
 #include "config.h"
 #endif
 
+#include <string.h>
+
 #include <libbamf/libbamf.h>
 #include <gio/gio.h>
 #include <gtk/gtk.h>
 #include <glib/gi18n.h>
-#include <gio/gdesktopappinfo.h>
-
+#include "desktop-cache.h"
+#include "entry-slab.h"
+#include "icon-cache.h"
 #include "window-menu-model.h"
 
+/* What all the windows of an application share: the application
+   menu, the application actions and the application's name */
+typedef struct _AppShared AppShared;
+struct _AppShared {
+	gint ref_count;
+	gchar * key;
+
+	GActionGroup * app_actions;
+
+	/* The model only exists while the menu is subscribed */
+	GDBusConnection * session;
+	gchar * bus_name;
+	gchar * app_menu_path;
+	GDBusMenuModel * app_menu_model;
+	guint release_timer;
+	gboolean persistent;
+
+	gchar * name;
+	gboolean name_loading;
+	GtkMenu * app_menu;
+
+	/* Windows with a label showing the name */
+	GList * windows;
+
+	/* The window whose actions the application menu is using */
+	WindowMenuModel * bound;
+};
+
+typedef struct _WindowMenuEntry WindowMenuEntry;
+struct _WindowMenuEntry {
+	IndicatorObjectEntry entry;
+
+	WindowMenuModel * menu;
+
+	/* Where the item is in the model, as of the last sync */
+	GMenuModel * parent;
+	gint index;
+
+	/* The submenu is only held while it's subscribed */
+	gboolean has_submenu;
+	GMenuModel * submenu;
+	gboolean bound;
+	guint release_timer;
+
+	/* The item's action, if it has one */
+	GActionGroup * group;
+	gchar * action;
+	gboolean action_dirty;
+};
+
 struct _WindowMenuModelPrivate {
 	guint xid;
+	WindowMenuLayout layout;
 
-	GtkAccelGroup * accel_group;
+	AppShared * app;
 	GActionGroup * app_actions;
 	GActionGroup * win_actions;
 	GActionGroup * unity_actions;
 
+	guint action_idle;
+
 	/* Application Menu */
-	GDBusMenuModel * app_menu_model;
 	IndicatorObjectEntry application_menu;
 	gboolean has_application_menu;
 
-	/* Window Menus */
+	/* Window Menus, in menubar order */
 	GDBusMenuModel * win_menu_model;
-	GtkMenuBar * win_menu;
+	GPtrArray * win_entries;
+	GPtrArray * win_sections;
+	EntrySlab * slab;
 };
 
 #define WINDOW_MENU_MODEL_GET_PRIVATE(o) \
@@ -62,6 +119,17 @@ static guint               get_location                 (WindowMenu * wm,
 static WindowMenuStatus    get_status                   (WindowMenu * wm);
 static gboolean            get_error_state              (WindowMenu * wm);
 static guint               get_xid                      (WindowMenu * wm);
+static void                entry_activate               (WindowMenu * wm,
+                                                         IndicatorObjectEntry * entry,
+                                                         guint timestamp);
+static void                unwatch_actions              (WindowMenuModel * menu,
+                                                         GActionGroup * group);
+static void                model_drop_sections          (WindowMenuModel * menu);
+static void                entry_bind                   (WindowMenuEntry * entry);
+static void                entry_free                   (WindowMenuEntry * entry);
+static void                app_shared_unref             (AppShared * app);
+static void                app_shared_bind              (AppShared * app,
+                                                         WindowMenuModel * menu);
 
 /* GLib boilerplate */
 G_DEFINE_TYPE (WindowMenuModel, window_menu_model, WINDOW_MENU_TYPE);
@@ -71,9 +139,6 @@ G_DEFINE_TYPE (WindowMenuModel, window_menu_model, WINDOW_MENU_TYPE);
 #define ACTION_MUX_PREFIX_WIN   "win"
 #define ACTION_MUX_PREFIX_UNITY "unity"
 
-/* Entry data on the menuitem */
-#define ENTRY_DATA  "window-menu-model-menuitem-entry"
-
 static void
 window_menu_model_class_init (WindowMenuModelClass *klass)
 {
@@ -90,6 +155,7 @@ window_menu_model_class_init (WindowMenuModelClass *klass)
 	wm_class->get_status = get_status;
 	wm_class->get_error_state = get_error_state;
 	wm_class->get_xid = get_xid;
+	wm_class->entry_activate = entry_activate;
 
 	return;
 }
@@ -99,7 +165,9 @@ window_menu_model_init (WindowMenuModel *self)
 {
 	self->priv = WINDOW_MENU_MODEL_GET_PRIVATE(self);
 
-	self->priv->accel_group = gtk_accel_group_new();
+	self->priv->win_entries = g_ptr_array_new();
+	self->priv->win_sections = g_ptr_array_new();
+	self->priv->slab = entry_slab_new(sizeof(WindowMenuEntry));
 
 	return;
 }
@@ -110,192 +178,388 @@ window_menu_model_dispose (GObject *object)
 	WindowMenuModel * menu = WINDOW_MENU_MODEL(object);
 
 	if (menu->priv->has_application_menu) {
-		g_signal_emit_by_name(menu, WINDOW_MENU_SIGNAL_ENTRY_REMOVED, &menu->priv->application_menu);
+		window_menu_emit_entry_removed(WINDOW_MENU(menu), &menu->priv->application_menu);
 		menu->priv->has_application_menu = FALSE;
 	}
 
-	g_clear_object(&menu->priv->accel_group);
-
 	/* Application Menu */
-	g_clear_object(&menu->priv->app_menu_model);
 	g_clear_object(&menu->priv->application_menu.label);
 	g_clear_object(&menu->priv->application_menu.menu);
 
 	/* Window Menus */
-	g_clear_object(&menu->priv->win_menu_model);
+	if (menu->priv->win_menu_model != NULL) {
+		g_signal_handlers_disconnect_by_data(menu->priv->win_menu_model, menu);
+		g_clear_object(&menu->priv->win_menu_model);
+	}
+
+	if (menu->priv->action_idle != 0) {
+		g_source_remove(menu->priv->action_idle);
+		menu->priv->action_idle = 0;
+	}
+
+	if (menu->priv->win_sections != NULL) {
+		model_drop_sections(menu);
+		g_ptr_array_free(menu->priv->win_sections, TRUE);
+		menu->priv->win_sections = NULL;
+	}
+
+	if (menu->priv->win_entries != NULL) {
+		guint i;
+		for (i = 0; i < menu->priv->win_entries->len; i++) {
+			WindowMenuEntry * entry = g_ptr_array_index(menu->priv->win_entries, i);
+			window_menu_emit_entry_removed(WINDOW_MENU(menu), &entry->entry);
+			entry_free(entry);
+		}
+		g_ptr_array_free(menu->priv->win_entries, TRUE);
+		menu->priv->win_entries = NULL;
+	}
+
+	if (menu->priv->slab != NULL) {
+		guint allocated, chunks;
+		entry_slab_get_stats(menu->priv->slab, &allocated, NULL, &chunks);
+		g_debug("Window %d made %u entries in %u chunks", menu->priv->xid, allocated, chunks);
 
-	if (menu->priv->win_menu) {
-		g_signal_handlers_disconnect_by_data(menu->priv->win_menu, menu);
-		gtk_widget_destroy (GTK_WIDGET (menu->priv->win_menu));
-		g_object_unref (menu->priv->win_menu);
-		menu->priv->win_menu = NULL;
+		entry_slab_destroy(menu->priv->slab);
+		menu->priv->slab = NULL;
 	}
 
+	unwatch_actions(menu, menu->priv->unity_actions);
+	unwatch_actions(menu, menu->priv->win_actions);
+	unwatch_actions(menu, menu->priv->app_actions);
+
 	g_clear_object(&menu->priv->unity_actions);
 	g_clear_object(&menu->priv->win_actions);
 	g_clear_object(&menu->priv->app_actions);
 
+	if (menu->priv->app != NULL) {
+		if (menu->priv->app->bound == menu) {
+			app_shared_bind(menu->priv->app, NULL);
+		}
+		menu->priv->app->windows = g_list_remove(menu->priv->app->windows, menu);
+		app_shared_unref(menu->priv->app);
+		menu->priv->app = NULL;
+	}
+
 	G_OBJECT_CLASS (window_menu_model_parent_class)->dispose (object);
 	return;
 }
 
-/* Adds the application menu and turns the whole thing into an object
-   entry that can be used elsewhere */
-static void
-add_application_menu (WindowMenuModel * menu, const gchar * appname, GMenuModel * model)
-{
-	g_return_if_fail(G_IS_MENU_MODEL(model));
+/* Shared application parts, keyed by bus name and object paths */
+static GHashTable * app_shared_table = NULL;
 
-	menu->priv->app_menu_model = (GDBusMenuModel*)g_object_ref(model);
-	menu->priv->application_menu.parent_window = menu->priv->xid;
+/* How long a closed menu stays subscribed, in case it gets opened
+   again right away */
+#define SUBMENU_RELEASE_DELAY  30
 
-	if (appname != NULL) {
-		menu->priv->application_menu.label = GTK_LABEL(gtk_label_new(appname));
-	} else {
-		menu->priv->application_menu.label = GTK_LABEL(gtk_label_new(_("Unknown Application Name")));
+/* Drop the application menu's items and model, which ends the
+   subscription with the application */
+static void
+app_shared_release (AppShared * app)
+{
+	if (app->release_timer != 0) {
+		g_source_remove(app->release_timer);
+		app->release_timer = 0;
 	}
-	g_object_ref_sink(menu->priv->application_menu.label);
-	gtk_widget_show(GTK_WIDGET(menu->priv->application_menu.label));
 
-	menu->priv->application_menu.menu = GTK_MENU(gtk_menu_new_from_model(model));
-	if (menu->priv->app_actions) {
-		gtk_widget_insert_action_group(GTK_WIDGET(menu->priv->application_menu.menu), ACTION_MUX_PREFIX_APP, menu->priv->app_actions);
+	if (app->app_menu_model == NULL) {
+		return;
 	}
-	if (menu->priv->win_actions) {
-		gtk_widget_insert_action_group(GTK_WIDGET(menu->priv->application_menu.menu), ACTION_MUX_PREFIX_WIN, menu->priv->win_actions);
+
+	gtk_menu_shell_bind_model(GTK_MENU_SHELL(app->app_menu), NULL, NULL, FALSE);
+	g_clear_object(&app->app_menu_model);
+
+	return;
+}
+
+static gboolean
+app_shared_release_cb (gpointer user_data)
+{
+	AppShared * app = (AppShared *)user_data;
+
+	app->release_timer = 0;
+	app_shared_release(app);
+
+	return G_SOURCE_REMOVE;
+}
+
+/* Fill the application menu when it's about to be shown */
+static void
+app_shared_subscribe (AppShared * app)
+{
+	if (app->release_timer != 0) {
+		g_source_remove(app->release_timer);
+		app->release_timer = 0;
 	}
-	if (menu->priv->unity_actions) {
-		gtk_widget_insert_action_group(GTK_WIDGET(menu->priv->application_menu.menu), ACTION_MUX_PREFIX_UNITY, menu->priv->unity_actions);
+
+	if (app->app_menu_model != NULL || app->app_menu == NULL) {
+		return;
 	}
 
-	gtk_widget_show(GTK_WIDGET(menu->priv->application_menu.menu));
-	g_object_ref_sink(menu->priv->application_menu.menu);
+	app->app_menu_model = g_dbus_menu_model_get(app->session, app->bus_name, app->app_menu_path);
+	gtk_menu_shell_bind_model(GTK_MENU_SHELL(app->app_menu), G_MENU_MODEL(app->app_menu_model), NULL, TRUE);
 
-	menu->priv->has_application_menu = TRUE;
-	g_signal_emit_by_name(menu, WINDOW_MENU_SIGNAL_ENTRY_ADDED, &menu->priv->application_menu);
+	return;
 }
 
-/* Find the label in a GTK MenuItem */
-GtkLabel *
-mi_find_label (GtkWidget * mi)
+/* The window of the app that has focus, which is the one the panel
+   is showing the application menu for.  NULL if it isn't one of ours. */
+static WindowMenuModel *
+app_shared_focused (AppShared * app)
 {
-	if (GTK_IS_LABEL(mi)) {
-		return GTK_LABEL(mi);
-	}
+	BamfMatcher * matcher = bamf_matcher_get_default();
+	BamfWindow * active = bamf_matcher_get_active_window(matcher);
+	WindowMenuModel * found = NULL;
+	GList * l;
 
-	GtkLabel * retval = NULL;
+	if (active != NULL) {
+		guint32 xid = bamf_window_get_xid(active);
 
-	if (GTK_IS_CONTAINER(mi)) {
-		GList * children = gtk_container_get_children(GTK_CONTAINER(mi));
-		GList * child = children;
+		for (l = app->windows; l != NULL; l = l->next) {
+			WindowMenuModel * menu = WINDOW_MENU_MODEL(l->data);
 
-		while (child != NULL && retval == NULL) {
-			if (GTK_IS_WIDGET(child->data)) {
-				retval = mi_find_label(GTK_WIDGET(child->data));
+			if (menu->priv->xid == xid) {
+				found = menu;
+				break;
 			}
-			child = g_list_next(child);
 		}
+	}
+
+	g_object_unref(matcher);
 
-		g_list_free(children);
+	return found;
+}
+
+/* However the menu gets opened, keyboard or click, it has to be using
+   the focused window's actions by the time it's on screen */
+static void
+app_shared_menu_show (GtkWidget * widget, gpointer user_data)
+{
+	AppShared * app = (AppShared *)user_data;
+	WindowMenuModel * focused = app_shared_focused(app);
+
+	if (focused != NULL && app->bound != focused) {
+		app_shared_bind(app, focused);
 	}
 
-	return retval;
+	app_shared_subscribe(app);
+	return;
 }
 
-/* Find the icon in a GTK MenuItem */
-GtkImage *
-mi_find_icon (GtkWidget * mi)
+static void
+app_shared_menu_hide (GtkWidget * widget, gpointer user_data)
 {
-	if (GTK_IS_IMAGE(mi)) {
-		return GTK_IMAGE(mi);
+	AppShared * app = (AppShared *)user_data;
+
+	if (!app->persistent && app->release_timer == 0) {
+		app->release_timer = g_timeout_add_seconds(SUBMENU_RELEASE_DELAY, app_shared_release_cb, app);
 	}
 
-	GtkImage * retval = NULL;
+	return;
+}
+
+static void
+app_shared_unref (AppShared * app)
+{
+	if (--app->ref_count > 0) {
+		return;
+	}
 
-	if (GTK_IS_CONTAINER(mi)) {
-		GList * children = gtk_container_get_children(GTK_CONTAINER(mi));
-		GList * child = children;
+	g_hash_table_remove(app_shared_table, app->key);
 
-		while (child != NULL && retval == NULL) {
-			if (GTK_IS_WIDGET(child->data)) {
-				retval = mi_find_icon(GTK_WIDGET(child->data));
-			}
-			child = g_list_next(child);
-		}
+	if (app->name_loading) {
+		desktop_cache_cancel(app);
+	}
 
-		g_list_free(children);
+	if (app->app_menu != NULL) {
+		app_shared_release(app);
+		g_signal_handlers_disconnect_by_data(app->app_menu, app);
+		gtk_widget_destroy(GTK_WIDGET(app->app_menu));
+		g_object_unref(app->app_menu);
 	}
 
-	return retval;
+	g_clear_object(&app->app_actions);
+	g_clear_object(&app->session);
+	g_free(app->bus_name);
+	g_free(app->app_menu_path);
+	g_free(app->name);
+	g_free(app->key);
+	g_free(app);
+
+	return;
 }
 
-/* Check the menu and make sure we return it if it's a menu
-   all proper like that */
-GtkMenu *
-mi_find_menu (GtkMenuItem * mi)
+/* The text for the application menu's label */
+static const gchar *
+app_shared_label (AppShared * app)
 {
-	GtkWidget * retval = gtk_menu_item_get_submenu(mi);
-	if (GTK_IS_MENU(retval)) {
-		return GTK_MENU(retval);
-	} else {
-		return NULL;
+	if (app->name != NULL) {
+		return app->name;
 	}
-}
 
-typedef struct _WindowMenuEntry WindowMenuEntry;
-struct _WindowMenuEntry {
-	IndicatorObjectEntry entry;
+	/* Blank is better than flashing the fallback while loading */
+	if (app->name_loading) {
+		return "";
+	}
 
-	GtkMenuItem * gmi;
-};
+	return _("Unknown Application Name");
+}
 
-/* Sync the menu label changing to the label object */
+/* The desktop file finished loading, update all the labels */
 static void
-entry_label_notify (GObject * obj, GParamSpec * pspec, gpointer user_data)
+app_shared_name_ready (const gchar * path, const gchar * name, gpointer user_data)
 {
-	g_return_if_fail(GTK_IS_MENU_ITEM(obj));
+	AppShared * app = (AppShared *)user_data;
+	GList * lwindow;
 
-	GtkMenuItem * gmi = GTK_MENU_ITEM(obj);
-	WindowMenuEntry * entry = (WindowMenuEntry *)user_data;
+	app->name_loading = FALSE;
+	app->name = g_strdup(name);
 
-	if (entry->entry.label != NULL) {
-		const gchar * label = gtk_menu_item_get_label(gmi);
-		gtk_label_set_label(entry->entry.label, label);
+	for (lwindow = app->windows; lwindow != NULL; lwindow = g_list_next(lwindow)) {
+		WindowMenuModel * menu = WINDOW_MENU_MODEL(lwindow->data);
+		gtk_label_set_text(menu->priv->application_menu.label, app_shared_label(app));
 	}
 
 	return;
 }
 
-/* Watch for visible changes and ensure they can be picked up by the
-   indicator object host */
+/* Look up the application's name from its desktop file, the cache
+   calls us back if it has to go to the disk for it */
 static void
-entry_visible_notify (GObject * obj, GParamSpec * pspec, gpointer user_data)
+app_shared_lookup_name (AppShared * app, BamfApplication * bamfapp)
 {
-	g_return_if_fail(GTK_IS_WIDGET(obj));
-	GtkWidget * widget = GTK_WIDGET(obj);
-	WindowMenuEntry * entry = (WindowMenuEntry *)user_data;
-	gboolean visible = gtk_widget_get_visible(widget);
+	const gchar * desktop_path = bamf_application_get_desktop_file(bamfapp);
+	const gchar * name = NULL;
 
-	if (entry->entry.label != NULL) {
-		gtk_widget_set_visible(GTK_WIDGET(entry->entry.label), visible);
+	if (desktop_path == NULL || desktop_path[0] == '\0') {
+		return;
 	}
 
-	if (entry->entry.image != NULL) {
-		gtk_widget_set_visible(GTK_WIDGET(entry->entry.image), visible);
+	if (desktop_cache_lookup_name(desktop_path, &name, app_shared_name_ready, app)) {
+		app->name = g_strdup(name);
+	} else {
+		app->name_loading = TRUE;
 	}
 
 	return;
 }
 
-/* Watch for sensitive changes and ensure they can be picked up by the
-   indicator object host */
+/* Get the parts shared with the application's other windows, building
+   them if this is the first window we've seen */
+static AppShared *
+app_shared_get (GDBusConnection * session, BamfApplication * bamfapp, const gchar * bus_name,
+                const gchar * application_path, const gchar * app_menu_path)
+{
+	gchar * key = g_strdup_printf("%s|%s|%s", bus_name,
+	                              application_path != NULL ? application_path : "",
+	                              app_menu_path != NULL ? app_menu_path : "");
+
+	if (app_shared_table == NULL) {
+		app_shared_table = g_hash_table_new(g_str_hash, g_str_equal);
+	}
+
+	AppShared * app = g_hash_table_lookup(app_shared_table, key);
+	if (app != NULL) {
+		g_free(key);
+		app->ref_count++;
+		return app;
+	}
+
+	app = g_new0(AppShared, 1);
+	app->ref_count = 1;
+	app->key = key;
+
+	if (application_path != NULL) {
+		app->app_actions = G_ACTION_GROUP(g_dbus_action_group_get (session, bus_name, application_path));
+	}
+
+	if (app_menu_path != NULL) {
+		app_shared_lookup_name(app, bamfapp);
+
+		app->session = g_object_ref(session);
+		app->bus_name = g_strdup(bus_name);
+		app->app_menu_path = g_strdup(app_menu_path);
+
+		app->app_menu = GTK_MENU(gtk_menu_new());
+		g_signal_connect(G_OBJECT(app->app_menu), "show", G_CALLBACK(app_shared_menu_show), app);
+		g_signal_connect(G_OBJECT(app->app_menu), "hide", G_CALLBACK(app_shared_menu_hide), app);
+
+		if (app->app_actions) {
+			gtk_widget_insert_action_group(GTK_WIDGET(app->app_menu), ACTION_MUX_PREFIX_APP, app->app_actions);
+		}
+
+		gtk_widget_show(GTK_WIDGET(app->app_menu));
+		g_object_ref_sink(app->app_menu);
+	}
+
+	g_hash_table_insert(app_shared_table, app->key, app);
+
+	return app;
+}
+
+/* Point the application menu at a window's actions, NULL takes them
+   out again */
 static void
-entry_sensitive_notify (GObject * obj, GParamSpec * pspec, gpointer user_data)
+app_shared_bind (AppShared * app, WindowMenuModel * menu)
 {
-	g_return_if_fail(GTK_IS_WIDGET(obj));
-	GtkWidget * widget = GTK_WIDGET(obj);
-	WindowMenuEntry * entry = (WindowMenuEntry *)user_data;
-	gboolean sensitive = gtk_widget_get_sensitive(widget);
+	if (app->app_menu == NULL) {
+		return;
+	}
+
+	GActionGroup * win_actions = menu != NULL ? menu->priv->win_actions : NULL;
+	GActionGroup * unity_actions = menu != NULL ? menu->priv->unity_actions : NULL;
+
+	gtk_widget_insert_action_group(GTK_WIDGET(app->app_menu), ACTION_MUX_PREFIX_WIN, win_actions);
+	gtk_widget_insert_action_group(GTK_WIDGET(app->app_menu), ACTION_MUX_PREFIX_UNITY, unity_actions);
+
+	app->bound = menu;
+
+	return;
+}
+
+/* Adds the application menu and turns the whole thing into an object
+   entry that can be used elsewhere.  The menu itself belongs to the
+   application, only the label is ours. */
+static void
+add_application_menu (WindowMenuModel * menu)
+{
+	AppShared * app = menu->priv->app;
+	g_return_if_fail(app != NULL && app->app_menu != NULL);
+
+	menu->priv->application_menu.parent_window = menu->priv->xid;
+
+	menu->priv->application_menu.label = GTK_LABEL(gtk_label_new(app_shared_label(app)));
+	g_object_ref_sink(menu->priv->application_menu.label);
+	gtk_widget_show(GTK_WIDGET(menu->priv->application_menu.label));
+	app->windows = g_list_prepend(app->windows, menu);
+
+	menu->priv->application_menu.menu = g_object_ref(app->app_menu);
+
+	/* One window wanting the full menu keeps it for all of them */
+	if (menu->priv->layout == WINDOW_MENU_LAYOUT_FULL) {
+		app->persistent = TRUE;
+		app_shared_subscribe(app);
+	}
+
+	if (app->bound == NULL) {
+		app_shared_bind(app, menu);
+	}
+
+	menu->priv->has_application_menu = TRUE;
+	window_menu_emit_entry_added(WINDOW_MENU(menu), &menu->priv->application_menu);
+}
+
+/* Make the entry's label and image follow its action.  Items without
+   an action, like most submenus, are always sensitive. */
+static void
+entry_update_sensitive (WindowMenuEntry * entry)
+{
+	gboolean sensitive = TRUE;
+
+	/* A missing action can't be activated either */
+	if (entry->group != NULL) {
+		sensitive = g_action_group_has_action(entry->group, entry->action) &&
+		            g_action_group_get_action_enabled(entry->group, entry->action);
+	}
 
 	if (entry->entry.label != NULL) {
 		gtk_widget_set_sensitive(GTK_WIDGET(entry->entry.label), sensitive);
@@ -308,131 +572,506 @@ entry_sensitive_notify (GObject * obj, GParamSpec * pspec, gpointer user_data)
 	return;
 }
 
-/* Destroy and unref the items of the object entry */
+/* Apply the action state to the entries that were marked */
+static gboolean
+action_idle_cb (gpointer user_data)
+{
+	WindowMenuModel * menu = WINDOW_MENU_MODEL(user_data);
+	guint i;
+
+	menu->priv->action_idle = 0;
+
+	for (i = 0; i < menu->priv->win_entries->len; i++) {
+		WindowMenuEntry * entry = g_ptr_array_index(menu->priv->win_entries, i);
+
+		if (!entry->action_dirty) {
+			continue;
+		}
+		entry->action_dirty = FALSE;
+
+		entry_update_sensitive(entry);
+	}
+
+	return G_SOURCE_REMOVE;
+}
+
+/* Mark the entries using an action, they get updated together once
+   the burst of action signals is over */
 static void
-entry_object_free (gpointer inentry)
+action_mark (WindowMenuModel * menu, GActionGroup * group, const gchar * action)
 {
-	WindowMenuEntry * entry = (WindowMenuEntry *)inentry;
+	gboolean marked = FALSE;
+	guint i;
 
-	g_signal_handlers_disconnect_by_data(entry->gmi, entry);
+	for (i = 0; i < menu->priv->win_entries->len; i++) {
+		WindowMenuEntry * entry = g_ptr_array_index(menu->priv->win_entries, i);
 
-	g_clear_object(&entry->entry.label);
-	g_clear_object(&entry->entry.image);
-	g_clear_object(&entry->entry.menu);
+		if (entry->group == group && g_strcmp0(entry->action, action) == 0) {
+			entry->action_dirty = TRUE;
+			marked = TRUE;
+		}
+	}
+
+	if (marked && menu->priv->action_idle == 0) {
+		menu->priv->action_idle = g_idle_add_full(G_PRIORITY_HIGH_IDLE + 10, action_idle_cb, menu, NULL);
+	}
+
+	return;
+}
 
-	g_free(entry);
+static void
+action_enabled_changed (GActionGroup * group, const gchar * action, gboolean enabled, gpointer user_data)
+{
+	action_mark(WINDOW_MENU_MODEL(user_data), group, action);
 	return;
 }
 
-/* Put an entry on a menu item */
 static void
-entry_on_menuitem (WindowMenuModel * menu, GtkMenuItem * gmi)
+action_added_removed (GActionGroup * group, const gchar * action, gpointer user_data)
 {
-	WindowMenuEntry * entry = g_new0(WindowMenuEntry, 1);
+	action_mark(WINDOW_MENU_MODEL(user_data), group, action);
+	return;
+}
 
-	entry->gmi = gmi;
+static void
+watch_actions (WindowMenuModel * menu, GActionGroup * group)
+{
+	if (group == NULL) {
+		return;
+	}
 
-	entry->entry.parent_window = menu->priv->xid;
-	entry->entry.label = mi_find_label(GTK_WIDGET(gmi));
-	entry->entry.image = mi_find_icon(GTK_WIDGET(gmi));
-	entry->entry.menu = mi_find_menu(gmi);
-
-	if (entry->entry.label == NULL && entry->entry.image == NULL) {
-		const gchar * label = gtk_menu_item_get_label(gmi);
-		if (label == NULL) {
-			g_warning("Item doesn't have a label or an image, aborting");
-			return;
+	g_signal_connect(G_OBJECT(group), "action-enabled-changed", G_CALLBACK(action_enabled_changed), menu);
+	g_signal_connect(G_OBJECT(group), "action-added", G_CALLBACK(action_added_removed), menu);
+	g_signal_connect(G_OBJECT(group), "action-removed", G_CALLBACK(action_added_removed), menu);
+
+	return;
+}
+
+static void
+unwatch_actions (WindowMenuModel * menu, GActionGroup * group)
+{
+	if (group == NULL) {
+		return;
+	}
+
+	g_signal_handlers_disconnect_by_data(group, menu);
+	return;
+}
+
+/* Split a muxer action name like "win.quit" into the group we have for
+   the prefix and the name inside of it */
+static void
+entry_set_action (WindowMenuEntry * entry, const gchar * action)
+{
+	WindowMenuModel * menu = entry->menu;
+	GActionGroup * group = NULL;
+	const gchar * dot = action != NULL ? strchr(action, '.') : NULL;
+
+	if (dot != NULL) {
+		if (strncmp(action, ACTION_MUX_PREFIX_APP ".", dot - action + 1) == 0) {
+			group = menu->priv->app_actions;
+		} else if (strncmp(action, ACTION_MUX_PREFIX_WIN ".", dot - action + 1) == 0) {
+			group = menu->priv->win_actions;
+		} else if (strncmp(action, ACTION_MUX_PREFIX_UNITY ".", dot - action + 1) == 0) {
+			group = menu->priv->unity_actions;
 		}
+	}
 
-		entry->entry.label = GTK_LABEL(gtk_label_new(label));
-		gtk_widget_show(GTK_WIDGET(entry->entry.label));
-		g_signal_connect(G_OBJECT(gmi), "notify::label", G_CALLBACK(entry_label_notify), entry);
+	g_free(entry->action);
+	entry->action = NULL;
+	entry->group = group;
+
+	if (group != NULL) {
+		entry->action = g_strdup(dot + 1);
 	}
-	if (entry->entry.label != NULL) {
+
+	return;
+}
+
+/* Drop the submenu's items and model, which ends the subscription
+   to it and everything below it */
+static void
+entry_release (WindowMenuEntry * entry)
+{
+	if (entry->release_timer != 0) {
+		g_source_remove(entry->release_timer);
+		entry->release_timer = 0;
+	}
+
+	if (!entry->bound) {
+		return;
+	}
+
+	gtk_menu_shell_bind_model(GTK_MENU_SHELL(entry->entry.menu), NULL, NULL, FALSE);
+	g_clear_object(&entry->submenu);
+	entry->bound = FALSE;
+
+	return;
+}
+
+static gboolean
+entry_release_cb (gpointer user_data)
+{
+	WindowMenuEntry * entry = (WindowMenuEntry *)user_data;
+
+	entry->release_timer = 0;
+	entry_release(entry);
+
+	return G_SOURCE_REMOVE;
+}
+
+/* Subscribe to the submenu when it's about to be opened */
+static void
+entry_bind (WindowMenuEntry * entry)
+{
+	if (entry->release_timer != 0) {
+		g_source_remove(entry->release_timer);
+		entry->release_timer = 0;
+	}
+
+	if (entry->bound || !entry->has_submenu) {
+		return;
+	}
+
+	entry->submenu = g_menu_model_get_item_link(entry->parent, entry->index, G_MENU_LINK_SUBMENU);
+	if (entry->submenu == NULL) {
+		return;
+	}
+
+	WindowMenuModel * menu = entry->menu;
+	GtkWidget * widget = GTK_WIDGET(entry->entry.menu);
+
+	if (menu->priv->app_actions)
+		gtk_widget_insert_action_group(widget, ACTION_MUX_PREFIX_APP, menu->priv->app_actions);
+	if (menu->priv->win_actions)
+		gtk_widget_insert_action_group(widget, ACTION_MUX_PREFIX_WIN, menu->priv->win_actions);
+	if (menu->priv->unity_actions)
+		gtk_widget_insert_action_group(widget, ACTION_MUX_PREFIX_UNITY, menu->priv->unity_actions);
+
+	gtk_menu_shell_bind_model(GTK_MENU_SHELL(widget), entry->submenu, NULL, TRUE);
+	entry->bound = TRUE;
+
+	return;
+}
+
+/* For hosts that pop the menu up without activating the entry */
+static void
+entry_menu_show (GtkWidget * widget, gpointer user_data)
+{
+	entry_bind((WindowMenuEntry *)user_data);
+	return;
+}
+
+/* Keep the subscription for a bit after the menu closes */
+static void
+entry_menu_hide (GtkWidget * widget, gpointer user_data)
+{
+	WindowMenuEntry * entry = (WindowMenuEntry *)user_data;
+
+	if (entry->menu->priv->layout == WINDOW_MENU_LAYOUT_ON_DEMAND && entry->bound && entry->release_timer == 0) {
+		entry->release_timer = g_timeout_add_seconds(SUBMENU_RELEASE_DELAY, entry_release_cb, entry);
+	}
+
+	return;
+}
+
+/* Build an entry from the item attributes.  The submenu starts out
+   empty and gets filled from the model when it's shown. */
+static WindowMenuEntry *
+entry_new (WindowMenuModel * menu, GMenuModel * model, gint index, const gchar * label, gboolean has_submenu)
+{
+	GtkWidget * image = NULL;
+
+#if GLIB_CHECK_VERSION(2, 38, 0)
+	GVariant * icon = g_menu_model_get_item_attribute_value(model, index, G_MENU_ATTRIBUTE_ICON, NULL);
+	if (icon != NULL) {
+		GIcon * gicon = g_icon_deserialize(icon);
+
+		/* Encoded icons are decoded once for everyone */
+		if (G_IS_BYTES_ICON(gicon)) {
+			gsize length = 0;
+			const guchar * data = g_bytes_get_data(g_bytes_icon_get_bytes(G_BYTES_ICON(gicon)), &length);
+			GdkPixbuf * pixbuf = data != NULL ? icon_cache_load_data(data, length) : NULL;
+
+			if (pixbuf != NULL) {
+				image = gtk_image_new_from_pixbuf(pixbuf);
+				g_object_unref(pixbuf);
+			}
+		} else if (gicon != NULL) {
+			image = gtk_image_new_from_gicon(gicon, GTK_ICON_SIZE_MENU);
+		}
+
+		g_clear_object(&gicon);
+
+		g_variant_unref(icon);
+	}
+#endif
+
+	if (label == NULL && image == NULL) {
+		g_warning("Item doesn't have a label or an image, aborting");
+		return NULL;
+	}
+
+	WindowMenuEntry * entry = entry_slab_alloc(menu->priv->slab);
+
+	entry->menu = menu;
+	entry->entry.parent_window = menu->priv->xid;
+
+	if (label != NULL) {
+		entry->entry.label = GTK_LABEL(gtk_label_new_with_mnemonic(label));
 		g_object_ref_sink(entry->entry.label);
+		gtk_widget_show(GTK_WIDGET(entry->entry.label));
 	}
 
-	if (entry->entry.image != NULL) {
+	if (image != NULL) {
+		entry->entry.image = GTK_IMAGE(image);
 		g_object_ref_sink(entry->entry.image);
+		gtk_widget_show(image);
 	}
 
-	if (entry->entry.menu != NULL) {
+	if (has_submenu) {
+		entry->has_submenu = TRUE;
+
+		entry->entry.menu = GTK_MENU(gtk_menu_new());
 		g_object_ref_sink(entry->entry.menu);
+		g_signal_connect(G_OBJECT(entry->entry.menu), "show", G_CALLBACK(entry_menu_show), entry);
+		g_signal_connect(G_OBJECT(entry->entry.menu), "hide", G_CALLBACK(entry_menu_hide), entry);
 	}
 
-	g_signal_connect(G_OBJECT(gmi), "notify::sensitive", G_CALLBACK(entry_sensitive_notify), entry);
-	g_signal_connect(G_OBJECT(gmi), "notify::visible", G_CALLBACK(entry_visible_notify), entry);
+	return entry;
+}
+
+/* Destroy and unref the items of the object entry */
+static void
+entry_free (WindowMenuEntry * entry)
+{
+	if (entry->entry.menu != NULL) {
+		entry_release(entry);
+		g_signal_handlers_disconnect_by_data(entry->entry.menu, entry);
+		gtk_widget_destroy(GTK_WIDGET(entry->entry.menu));
+	}
 
-	g_object_set_data_full(G_OBJECT(gmi), ENTRY_DATA, entry, entry_object_free);
+	g_clear_object(&entry->entry.label);
+	g_clear_object(&entry->entry.image);
+	g_clear_object(&entry->entry.menu);
+	g_clear_object(&entry->submenu);
 
+	g_free(entry->action);
+	entry_slab_free(entry->menu->priv->slab, entry);
 	return;
 }
 
-/* A child item was added to a menu we're watching.  Let's try to integrate it. */
-static void
-item_inserted_cb (GtkContainer *menu,
-                  GtkWidget    *widget,
-                  gint          position,
-                  gpointer      data)
+/* Find an entry we already have for the item, so that changes to the
+   menubar don't tear down entries that are still there */
+static WindowMenuEntry *
+entry_take (GPtrArray * entries, const gchar * label, GMenuModel * submenu)
 {
-	if (g_object_get_data(G_OBJECT(widget), ENTRY_DATA) == NULL) {
-		entry_on_menuitem(WINDOW_MENU_MODEL(data), GTK_MENU_ITEM(widget));
+	guint i;
+
+	for (i = 0; i < entries->len; i++) {
+		WindowMenuEntry * entry = g_ptr_array_index(entries, i);
+		gboolean match;
+
+		if (entry->submenu != NULL) {
+			/* Subscribed submenus are the same model as the link */
+			match = (entry->submenu == submenu);
+		} else {
+			match = (entry->has_submenu == (submenu != NULL) && entry->entry.label != NULL &&
+			         g_strcmp0(gtk_label_get_label(entry->entry.label), label) == 0);
+		}
+
+		if (match) {
+			g_ptr_array_remove_index(entries, i);
+			return entry;
+		}
 	}
 
-	if (g_object_get_data(G_OBJECT(widget), ENTRY_DATA) != NULL) {
-		g_signal_emit_by_name(data, WINDOW_MENU_SIGNAL_ENTRY_ADDED, g_object_get_data(G_OBJECT(widget), ENTRY_DATA));
+	return NULL;
+}
+
+static void model_items_changed (GMenuModel * model, gint position, gint removed, gint added, gpointer user_data);
+
+/* Turn the items of the model into entries, a section at the top
+   level gets flattened into the menubar like GTK does */
+static void
+model_sync_items (WindowMenuModel * menu, GMenuModel * model, gboolean toplevel, GPtrArray * old, GPtrArray * entries, GPtrArray * added)
+{
+	gint n_items = g_menu_model_get_n_items(model);
+	gint i;
+
+	for (i = 0; i < n_items; i++) {
+		GMenuModel * section = g_menu_model_get_item_link(model, i, G_MENU_LINK_SECTION);
+		if (section != NULL) {
+			if (toplevel) {
+				g_signal_connect(G_OBJECT(section), "items-changed", G_CALLBACK(model_items_changed), menu);
+				g_ptr_array_add(menu->priv->win_sections, section);
+				model_sync_items(menu, section, FALSE, old, entries, added);
+			} else {
+				g_object_unref(section);
+			}
+			continue;
+		}
+
+		gchar * label = NULL;
+		gchar * action = NULL;
+		GMenuModel * submenu = g_menu_model_get_item_link(model, i, G_MENU_LINK_SUBMENU);
+
+		g_menu_model_get_item_attribute(model, i, G_MENU_ATTRIBUTE_LABEL, "s", &label);
+		g_menu_model_get_item_attribute(model, i, G_MENU_ATTRIBUTE_ACTION, "s", &action);
+
+		WindowMenuEntry * entry = entry_take(old, label, submenu);
+		if (entry != NULL) {
+			if (label != NULL && entry->entry.label != NULL &&
+			    g_strcmp0(gtk_label_get_label(entry->entry.label), label) != 0) {
+				gtk_label_set_label(entry->entry.label, label);
+			}
+		} else {
+			entry = entry_new(menu, model, i, label, submenu != NULL);
+			if (entry != NULL) {
+				g_ptr_array_add(added, entry);
+			}
+		}
+
+		if (entry != NULL) {
+			entry->parent = model;
+			entry->index = i;
+			entry_set_action(entry, action);
+
+			if (menu->priv->layout == WINDOW_MENU_LAYOUT_FULL) {
+				entry_bind(entry);
+			}
+			entry_update_sensitive(entry);
+			g_ptr_array_add(entries, entry);
+		}
+
+		g_clear_object(&submenu);
+		g_free(action);
+		g_free(label);
 	}
 
 	return;
 }
 
-/* A child item was removed from a menu we're watching. */
+/* Stop listening to the sections we flattened */
 static void
-item_removed_cb (GtkContainer *menu, GtkWidget *widget, gpointer data)
+model_drop_sections (WindowMenuModel * menu)
 {
-	g_signal_emit_by_name(data, WINDOW_MENU_SIGNAL_ENTRY_REMOVED, g_object_get_data(G_OBJECT(widget), ENTRY_DATA));
+	guint i;
+
+	for (i = 0; i < menu->priv->win_sections->len; i++) {
+		GMenuModel * section = g_ptr_array_index(menu->priv->win_sections, i);
+		g_signal_handlers_disconnect_by_data(section, menu);
+		g_object_unref(section);
+	}
+	g_ptr_array_set_size(menu->priv->win_sections, 0);
+
+	return;
 }
 
-/* Adds the window menu and turns it into a set of IndicatorObjectEntries
-   that can be used elsewhere */
+/* Where the entry sits in the host's copy of our order */
+static guint
+view_index (GArray * view, WindowMenuEntry * entry)
+{
+	guint i;
+
+	for (i = 0; i < view->len; i++) {
+		if (g_array_index(view, WindowMenuEntry *, i) == entry) {
+			break;
+		}
+	}
+
+	return i;
+}
+
+/* Bring the entries in line with the model.  Entries that are still
+   there are kept, and moved if they need to be.  The view follows the
+   order the host has after each signal, so that every position we
+   send is one it can make sense of. */
 static void
-add_window_menu (WindowMenuModel * menu, GMenuModel * model)
+model_sync (WindowMenuModel * menu)
 {
-	menu->priv->win_menu_model = (GDBusMenuModel*)g_object_ref(model);
+	GPtrArray * old = g_ptr_array_sized_new(menu->priv->win_entries->len);
+	GPtrArray * old_order = menu->priv->win_entries;
+	GPtrArray * added = g_ptr_array_new();
+	GArray * view = g_array_sized_new(FALSE, FALSE, sizeof(WindowMenuEntry *), old_order->len);
+	guint offset = menu->priv->has_application_menu ? 1 : 0;
+	guint i;
+
+	for (i = 0; i < old_order->len; i++) {
+		g_ptr_array_add(old, g_ptr_array_index(old_order, i));
+	}
+	g_array_append_vals(view, old_order->pdata, old_order->len);
 
-	menu->priv->win_menu = GTK_MENU_BAR(gtk_menu_bar_new_from_model(model));
-	g_assert(menu->priv->win_menu != NULL);
-	g_object_ref_sink(menu->priv->win_menu);
+	model_drop_sections(menu);
 
-	if (menu->priv->app_actions)
-		gtk_widget_insert_action_group(GTK_WIDGET(menu->priv->win_menu), ACTION_MUX_PREFIX_APP, menu->priv->app_actions);
-	if (menu->priv->win_actions)
-		gtk_widget_insert_action_group(GTK_WIDGET(menu->priv->win_menu), ACTION_MUX_PREFIX_WIN, menu->priv->win_actions);
-	if (menu->priv->unity_actions)
-		gtk_widget_insert_action_group(GTK_WIDGET(menu->priv->win_menu), ACTION_MUX_PREFIX_UNITY, menu->priv->unity_actions);
+	menu->priv->win_entries = g_ptr_array_new();
+	model_sync_items(menu, G_MENU_MODEL(menu->priv->win_menu_model), TRUE, old, menu->priv->win_entries, added);
 
-	g_signal_connect(G_OBJECT(menu->priv->win_menu), "insert", G_CALLBACK (item_inserted_cb), menu);
-	g_signal_connect(G_OBJECT(menu->priv->win_menu), "remove", G_CALLBACK (item_removed_cb), menu);
+	/* Whatever wasn't taken is gone */
+	for (i = 0; i < old->len; i++) {
+		WindowMenuEntry * entry = g_ptr_array_index(old, i);
+		g_array_remove_index(view, view_index(view, entry));
+		window_menu_emit_entry_removed(WINDOW_MENU(menu), &entry->entry);
+		entry_free(entry);
+	}
 
-	GList * children = gtk_container_get_children(GTK_CONTAINER(menu->priv->win_menu));
-	GList * child;
-	for (child = children; child != NULL; child = g_list_next(child)) {
-		GtkMenuItem * gmi = GTK_MENU_ITEM(child->data);
+	/* Everything before i already matches, so each entry only ever
+	   moves forward into place.  New ones go in at the end first. */
+	for (i = 0; i < menu->priv->win_entries->len; i++) {
+		WindowMenuEntry * entry = g_ptr_array_index(menu->priv->win_entries, i);
+		guint j;
 
-		if (gmi == NULL) {
-			continue;
+		for (j = 0; j < added->len; j++) {
+			if (g_ptr_array_index(added, j) == entry) {
+				break;
+			}
+		}
+
+		if (j < added->len) {
+			g_array_append_val(view, entry);
+			window_menu_emit_entry_added(WINDOW_MENU(menu), &entry->entry);
 		}
 
-		entry_on_menuitem(menu, gmi);
+		j = view_index(view, entry);
+		if (j != i) {
+			g_array_remove_index(view, j);
+			g_array_insert_val(view, i, entry);
+			window_menu_emit_entry_moved(WINDOW_MENU(menu), &entry->entry, j + offset, i + offset);
+		}
 	}
-	g_list_free(children);
+
+	g_array_free(view, TRUE);
+	g_ptr_array_free(added, TRUE);
+	g_ptr_array_free(old, TRUE);
+	g_ptr_array_free(old_order, TRUE);
+
+	return;
+}
+
+static void
+model_items_changed (GMenuModel * model, gint position, gint removed, gint added, gpointer user_data)
+{
+	model_sync(WINDOW_MENU_MODEL(user_data));
+	return;
+}
+
+/* Adds the window menu and turns it into a set of IndicatorObjectEntries
+   that can be used elsewhere */
+static void
+add_window_menu (WindowMenuModel * menu, GMenuModel * model)
+{
+	menu->priv->win_menu_model = (GDBusMenuModel*)g_object_ref(model);
+
+	g_signal_connect(G_OBJECT(model), "items-changed", G_CALLBACK(model_items_changed), menu);
+
+	model_sync(menu);
 
 	return;
 }
 
 /* Builds the menu model from the window for the application */
 WindowMenuModel *
-window_menu_model_new (BamfApplication * app, BamfWindow * window)
+window_menu_model_new (BamfApplication * app, BamfWindow * window, WindowMenuLayout layout)
 {
 	g_return_val_if_fail(BAMF_IS_APPLICATION(app), NULL);
 	g_return_val_if_fail(BAMF_IS_WINDOW(window), NULL);
@@ -440,6 +1079,7 @@ window_menu_model_new (BamfApplication * app, BamfWindow * window)
 	WindowMenuModel * menu = g_object_new(WINDOW_MENU_MODEL_TYPE, NULL);
 
 	menu->priv->xid = bamf_window_get_xid(window);
+	menu->priv->layout = layout;
 
 	gchar *unique_bus_name;
 	gchar *app_menu_object_path;
@@ -465,8 +1105,12 @@ window_menu_model_new (BamfApplication * app, BamfWindow * window)
 	session = g_bus_get_sync (G_BUS_TYPE_SESSION, NULL, NULL);
 
 	/* Setup actions */
-	if (application_object_path != NULL) {
-		menu->priv->app_actions = G_ACTION_GROUP(g_dbus_action_group_get (session, unique_bus_name, application_object_path));
+	if (application_object_path != NULL || app_menu_object_path != NULL) {
+		menu->priv->app = app_shared_get(session, app, unique_bus_name, application_object_path, app_menu_object_path);
+
+		if (menu->priv->app->app_actions != NULL) {
+			menu->priv->app_actions = g_object_ref(menu->priv->app->app_actions);
+		}
 	}
 
 	if (window_object_path != NULL) {
@@ -479,25 +1123,7 @@ window_menu_model_new (BamfApplication * app, BamfWindow * window)
 
 	/* Build us some menus */
 	if (app_menu_object_path != NULL) {
-		const gchar * desktop_path = bamf_application_get_desktop_file(app);
-		gchar * app_name = NULL;
-
-		if (desktop_path != NULL) {
-			GDesktopAppInfo * desktop = g_desktop_app_info_new_from_filename(desktop_path);
-
-			if (desktop != NULL) {
-				app_name = g_strdup(g_app_info_get_name(G_APP_INFO(desktop)));
-
-				g_object_unref(desktop);
-			}
-		}
-
-		GMenuModel * model = G_MENU_MODEL(g_dbus_menu_model_get (session, unique_bus_name, app_menu_object_path));
-
-		add_application_menu(menu, app_name, model);
-
-		g_object_unref(model);
-		g_free(app_name);
+		add_application_menu(menu);
 	}
 
 	if (menubar_object_path != NULL) {
@@ -508,9 +1134,10 @@ window_menu_model_new (BamfApplication * app, BamfWindow * window)
 		g_object_unref(model);
 	}
 
-	/* when the action groups change, we could end up having items
-	 * enabled/disabled.  how to deal with that?
-	 */
+	/* Top level items with actions follow the action state */
+	watch_actions(menu, menu->priv->app_actions);
+	watch_actions(menu, menu->priv->win_actions);
+	watch_actions(menu, menu->priv->unity_actions);
 
 	g_free (unique_bus_name);
 	g_free (app_menu_object_path);
@@ -537,26 +1164,12 @@ get_entries (WindowMenu * wm)
 		ret = g_list_append(ret, &menu->priv->application_menu);
 	}
 
-	if (menu->priv->win_menu != NULL) {
-		GList * children = gtk_container_get_children(GTK_CONTAINER(menu->priv->win_menu));
-		GList * child;
-		for (child = children; child != NULL; child = g_list_next(child)) {
-			gpointer entry = g_object_get_data(child->data, ENTRY_DATA);
-
-			if (entry == NULL) {
-				/* Try to build the entry, it is possible (but unlikely) that
-				   we could beat the signal that this isn't created.  So we'll
-				   just handle that race here */
-				entry_on_menuitem(menu, GTK_MENU_ITEM(child->data));
-				entry = g_object_get_data(child->data, ENTRY_DATA);
-			}
-
-			if (entry != NULL) {
-				ret = g_list_append(ret, entry);
-			}
+	if (menu->priv->win_entries != NULL) {
+		guint i;
+		for (i = 0; i < menu->priv->win_entries->len; i++) {
+			WindowMenuEntry * entry = g_ptr_array_index(menu->priv->win_entries, i);
+			ret = g_list_append(ret, &entry->entry);
 		}
-
-		g_list_free(children);
 	}
 
 	return ret;
@@ -583,19 +1196,16 @@ get_location (WindowMenu * wm, IndicatorObjectEntry * entry)
 		}
 	}
 
-	if (menu->priv->win_menu != NULL) {
-		GList * children = gtk_container_get_children(GTK_CONTAINER(menu->priv->win_menu));
-		GList * child;
-		for (child = children; child != NULL; child = g_list_next(child), pos++) {
-			gpointer lentry = g_object_get_data(child->data, ENTRY_DATA);
+	if (menu->priv->win_entries != NULL && !found) {
+		guint i;
+		for (i = 0; i < menu->priv->win_entries->len; i++, pos++) {
+			WindowMenuEntry * lentry = g_ptr_array_index(menu->priv->win_entries, i);
 
-			if (entry == lentry) {
+			if (entry == &lentry->entry) {
 				found = TRUE;
 				break;
 			}
 		}
-
-		g_list_free(children);
 	}
 
 	if (!found) {
@@ -632,3 +1242,36 @@ get_xid (WindowMenu * wm)
 	g_return_val_if_fail(IS_WINDOW_MENU_MODEL(wm), 0);
 	return WINDOW_MENU_MODEL(wm)->priv->xid;
 }
+
+/* The application menu is shared by all the windows of the app, make
+   sure it's using the actions of the window it's being shown for */
+static void
+entry_activate (WindowMenu * wm, IndicatorObjectEntry * entry, guint timestamp)
+{
+	g_return_if_fail(IS_WINDOW_MENU_MODEL(wm));
+	WindowMenuModel * menu = WINDOW_MENU_MODEL(wm);
+
+	if (entry == &menu->priv->application_menu) {
+		if (menu->priv->app != NULL) {
+			if (menu->priv->app->bound != menu) {
+				app_shared_bind(menu->priv->app, menu);
+			}
+			app_shared_subscribe(menu->priv->app);
+		}
+		return;
+	}
+
+	if (menu->priv->win_entries != NULL) {
+		guint i;
+		for (i = 0; i < menu->priv->win_entries->len; i++) {
+			WindowMenuEntry * lentry = g_ptr_array_index(menu->priv->win_entries, i);
+
+			if (entry == &lentry->entry) {
+				entry_bind(lentry);
+				break;
+			}
+		}
+	}
+
+	return;
+}
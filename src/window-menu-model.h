@@ -49,7 +49,7 @@ struct _WindowMenuModel {
 };
 
 GType window_menu_model_get_type (void);
-WindowMenuModel * window_menu_model_new (BamfApplication * app, BamfWindow * window);
+WindowMenuModel * window_menu_model_new (BamfApplication * app, BamfWindow * window, WindowMenuLayout layout);
 
 G_END_DECLS
 
@@ -32,6 +32,7 @@
 enum {
 	ENTRY_ADDED,
 	ENTRY_REMOVED,
+	ENTRY_MOVED,
 	ERROR_STATE,
 	STATUS_CHANGED,
 	SHOW_MENU,
@@ -73,6 +74,13 @@ window_menu_class_init (WindowMenuClass *klass)
 	                                      NULL, NULL,
 	                                      g_cclosure_marshal_VOID__POINTER,
 	                                      G_TYPE_NONE, 1, G_TYPE_POINTER);
+	signals[ENTRY_MOVED] =   g_signal_new(WINDOW_MENU_SIGNAL_ENTRY_MOVED,
+	                                      G_TYPE_FROM_CLASS(klass),
+	                                      G_SIGNAL_RUN_LAST,
+	                                      G_STRUCT_OFFSET (WindowMenuClass, entry_moved),
+	                                      NULL, NULL,
+	                                      _indicator_appmenu_marshal_VOID__POINTER_UINT_UINT,
+	                                      G_TYPE_NONE, 3, G_TYPE_POINTER, G_TYPE_UINT, G_TYPE_UINT);
 	signals[ERROR_STATE] =   g_signal_new(WINDOW_MENU_SIGNAL_ERROR_STATE,
 	                                      G_TYPE_FROM_CLASS(klass),
 	                                      G_SIGNAL_RUN_LAST,
@@ -102,6 +110,14 @@ window_menu_class_init (WindowMenuClass *klass)
 	                                      _indicator_appmenu_marshal_VOID__POINTER,
 	                                      G_TYPE_NONE, 1, G_TYPE_POINTER, G_TYPE_NONE);
 
+	/* The entry signals are emitted for every item in a menu rebuild,
+	   let them skip packing their arguments into GValues */
+	g_signal_set_va_marshaller(signals[ENTRY_ADDED], G_TYPE_FROM_CLASS(klass), g_cclosure_marshal_VOID__POINTERv);
+	g_signal_set_va_marshaller(signals[ENTRY_REMOVED], G_TYPE_FROM_CLASS(klass), g_cclosure_marshal_VOID__POINTERv);
+	g_signal_set_va_marshaller(signals[ERROR_STATE], G_TYPE_FROM_CLASS(klass), g_cclosure_marshal_VOID__BOOLEANv);
+	g_signal_set_va_marshaller(signals[STATUS_CHANGED], G_TYPE_FROM_CLASS(klass), g_cclosure_marshal_VOID__INTv);
+	g_signal_set_va_marshaller(signals[A11Y_UPDATE], G_TYPE_FROM_CLASS(klass), g_cclosure_marshal_VOID__POINTERv);
+
 	return;
 }
 
@@ -230,3 +246,221 @@ window_menu_entry_activate (WindowMenu * wm, IndicatorObjectEntry * entry, guint
 		return;
 	}
 }
+
+/* Accelerator groups are per application, keyed by whatever the
+   backend knows the application by.  None of them are ever attached
+   to a window so they're only there for the accel labels.  Each goes
+   away with its last reference. */
+static GHashTable * accel_groups = NULL;
+static GQuark accel_table_quark = 0;
+static GQuark item_accel_quark = 0;
+
+/* One closure for each accelerator an application uses, shared by
+   all the items showing it */
+typedef struct _AccelRecord AccelRecord;
+struct _AccelRecord {
+	GClosure * closure;
+	guint refs;
+};
+
+/* What an item has taken from its group */
+typedef struct _ItemAccel ItemAccel;
+struct _ItemAccel {
+	GtkAccelGroup * group;
+	guint key;
+	GdkModifierType mods;
+};
+
+static void
+accel_group_gone (gpointer data, GObject * where_the_object_was)
+{
+	g_hash_table_remove(accel_groups, data);
+	return;
+}
+
+GtkAccelGroup *
+window_menu_get_accel_group (const gchar * app)
+{
+	if (app == NULL) {
+		app = "";
+	}
+
+	if (accel_groups == NULL) {
+		accel_groups = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+		accel_table_quark = g_quark_from_static_string("window-menu-accel-table");
+		item_accel_quark = g_quark_from_static_string("window-menu-item-accel");
+	}
+
+	GtkAccelGroup * group = g_hash_table_lookup(accel_groups, app);
+	if (group != NULL) {
+		return g_object_ref(group);
+	}
+
+	gchar * key = g_strdup(app);
+	group = gtk_accel_group_new();
+	g_hash_table_insert(accel_groups, key, group);
+	g_object_weak_ref(G_OBJECT(group), accel_group_gone, key);
+	g_object_set_qdata_full(G_OBJECT(group), accel_table_quark,
+	                        g_hash_table_new_full(g_int64_hash, g_int64_equal, g_free, g_free),
+	                        (GDestroyNotify)g_hash_table_destroy);
+
+	return group;
+}
+
+/* The groups are never attached, so nothing ever gets here */
+static gboolean
+accel_activate (GtkAccelGroup * group, GObject * acceleratable, guint key, GdkModifierType mods, gpointer user_data)
+{
+	return FALSE;
+}
+
+static gint64
+accel_hash_key (guint key, GdkModifierType mods)
+{
+	return ((gint64)mods << 32) | key;
+}
+
+/* Drop the item's hold on its accelerator, and the closure with the
+   last item using it */
+static void
+item_accel_free (gpointer data)
+{
+	ItemAccel * accel = (ItemAccel *)data;
+	GHashTable * table = g_object_get_qdata(G_OBJECT(accel->group), accel_table_quark);
+	gint64 hash_key = accel_hash_key(accel->key, accel->mods);
+	AccelRecord * record = g_hash_table_lookup(table, &hash_key);
+
+	if (record != NULL && --record->refs == 0) {
+		gtk_accel_group_disconnect(accel->group, record->closure);
+		g_hash_table_remove(table, &hash_key);
+	}
+
+	g_object_unref(accel->group);
+	g_free(accel);
+	return;
+}
+
+/* Find the accel label somewhere in the item */
+static void
+find_accel_label_cb (GtkWidget * widget, gpointer user_data)
+{
+	GtkAccelLabel ** label = (GtkAccelLabel **)user_data;
+
+	if (*label != NULL) {
+		return;
+	}
+
+	if (GTK_IS_ACCEL_LABEL(widget)) {
+		*label = GTK_ACCEL_LABEL(widget);
+	} else if (GTK_IS_CONTAINER(widget)) {
+		gtk_container_forall(GTK_CONTAINER(widget), find_accel_label_cb, user_data);
+	}
+
+	return;
+}
+
+/* Show an accelerator on the item's label, using the closure the
+   application already has for it if there is one.  A key of zero
+   takes the accelerator off. */
+void
+window_menu_set_item_accel (GtkAccelGroup * group, GtkWidget * item, guint key, GdkModifierType mods)
+{
+	g_return_if_fail(GTK_IS_ACCEL_GROUP(group));
+	g_return_if_fail(GTK_IS_WIDGET(item));
+
+	ItemAccel * accel = g_object_get_qdata(G_OBJECT(item), item_accel_quark);
+	if (accel == NULL && key == 0) {
+		return;
+	}
+	if (accel != NULL && accel->group == group && accel->key == key && accel->mods == mods) {
+		return;
+	}
+
+	GtkAccelLabel * label = NULL;
+	gtk_container_forall(GTK_CONTAINER(item), find_accel_label_cb, &label);
+
+	if (key == 0 || label == NULL) {
+		if (label != NULL) {
+			gtk_accel_label_set_accel_closure(label, NULL);
+		}
+		g_object_set_qdata(G_OBJECT(item), item_accel_quark, NULL);
+		return;
+	}
+
+	GHashTable * table = g_object_get_qdata(G_OBJECT(group), accel_table_quark);
+	gint64 hash_key = accel_hash_key(key, mods);
+	AccelRecord * record = g_hash_table_lookup(table, &hash_key);
+
+	if (record == NULL) {
+		record = g_new0(AccelRecord, 1);
+		record->closure = g_cclosure_new(G_CALLBACK(accel_activate), NULL, NULL);
+		gtk_accel_group_connect(group, key, mods, GTK_ACCEL_VISIBLE, record->closure);
+		gint64 * table_key = g_new(gint64, 1);
+		*table_key = hash_key;
+		g_hash_table_insert(table, table_key, record);
+	}
+	record->refs++;
+
+	gtk_accel_label_set_accel_closure(label, record->closure);
+
+	/* Replacing the old one lets go of its closure */
+	accel = g_new0(ItemAccel, 1);
+	accel->group = g_object_ref(group);
+	accel->key = key;
+	accel->mods = mods;
+	g_object_set_qdata_full(G_OBJECT(item), item_accel_quark, accel, item_accel_free);
+
+	return;
+}
+
+/**************************
+  Signal Emission
+ **************************/
+void
+window_menu_emit_entry_added (WindowMenu * wm, IndicatorObjectEntry * entry)
+{
+	g_return_if_fail (IS_WINDOW_MENU(wm));
+	g_signal_emit(wm, signals[ENTRY_ADDED], 0, entry);
+}
+
+void
+window_menu_emit_entry_removed (WindowMenu * wm, IndicatorObjectEntry * entry)
+{
+	g_return_if_fail (IS_WINDOW_MENU(wm));
+	g_signal_emit(wm, signals[ENTRY_REMOVED], 0, entry);
+}
+
+void
+window_menu_emit_entry_moved (WindowMenu * wm, IndicatorObjectEntry * entry, guint old_pos, guint new_pos)
+{
+	g_return_if_fail (IS_WINDOW_MENU(wm));
+	g_signal_emit(wm, signals[ENTRY_MOVED], 0, entry, old_pos, new_pos);
+}
+
+void
+window_menu_emit_error_state (WindowMenu * wm, gboolean state)
+{
+	g_return_if_fail (IS_WINDOW_MENU(wm));
+	g_signal_emit(wm, signals[ERROR_STATE], 0, state);
+}
+
+void
+window_menu_emit_status_changed (WindowMenu * wm, WindowMenuStatus status)
+{
+	g_return_if_fail (IS_WINDOW_MENU(wm));
+	g_signal_emit(wm, signals[STATUS_CHANGED], 0, status);
+}
+
+void
+window_menu_emit_show_menu (WindowMenu * wm, IndicatorObjectEntry * entry, guint timestamp)
+{
+	g_return_if_fail (IS_WINDOW_MENU(wm));
+	g_signal_emit(wm, signals[SHOW_MENU], 0, entry, timestamp);
+}
+
+void
+window_menu_emit_a11y_update (WindowMenu * wm, IndicatorObjectEntry * entry)
+{
+	g_return_if_fail (IS_WINDOW_MENU(wm));
+	g_signal_emit(wm, signals[A11Y_UPDATE], 0, entry);
+}
@@ -36,6 +36,7 @@ G_BEGIN_DECLS
 
 #define WINDOW_MENU_SIGNAL_ENTRY_ADDED    "entry-added"
 #define WINDOW_MENU_SIGNAL_ENTRY_REMOVED  "entry-removed"
+#define WINDOW_MENU_SIGNAL_ENTRY_MOVED    "entry-moved"
 #define WINDOW_MENU_SIGNAL_ERROR_STATE    "error-state"
 #define WINDOW_MENU_SIGNAL_STATUS_CHANGED "status-changed"
 #define WINDOW_MENU_SIGNAL_SHOW_MENU      "show-menu"
@@ -47,6 +48,13 @@ enum _WindowMenuStatus {
 	WINDOW_MENU_STATUS_ACTIVE
 };
 
+/* How much of the menu to fetch before it's opened */
+typedef enum _WindowMenuLayout WindowMenuLayout;
+enum _WindowMenuLayout {
+	WINDOW_MENU_LAYOUT_FULL,
+	WINDOW_MENU_LAYOUT_ON_DEMAND
+};
+
 typedef struct _WindowMenu      WindowMenu;
 typedef struct _WindowMenuClass WindowMenuClass;
 
@@ -68,6 +76,7 @@ struct _WindowMenuClass {
 	/* Signals */
 	void (*entry_added)    (WindowMenu * wm, IndicatorObjectEntry * entry, gpointer user_data);
 	void (*entry_removed)  (WindowMenu * wm, IndicatorObjectEntry * entry, gpointer user_data);
+	void (*entry_moved)    (WindowMenu * wm, IndicatorObjectEntry * entry, guint old_pos, guint new_pos, gpointer user_data);
 
 	void (*error_state)    (WindowMenu * wm, gboolean state, gpointer user_data);
 	void (*status_changed) (WindowMenu * wm, WindowMenuStatus status, gpointer user_data);
@@ -93,6 +102,19 @@ void window_menu_entry_restore (WindowMenu * wm, IndicatorObjectEntry * entry);
 
 void window_menu_entry_activate (WindowMenu * wm, IndicatorObjectEntry * entry, guint timestamp);
 
+GtkAccelGroup * window_menu_get_accel_group (const gchar * app);
+void window_menu_set_item_accel (GtkAccelGroup * group, GtkWidget * item, guint key, GdkModifierType mods);
+
+/* Signal emission for the subclasses, uses the signal IDs that were
+   resolved at class init instead of looking them up by name */
+void window_menu_emit_entry_added (WindowMenu * wm, IndicatorObjectEntry * entry);
+void window_menu_emit_entry_removed (WindowMenu * wm, IndicatorObjectEntry * entry);
+void window_menu_emit_entry_moved (WindowMenu * wm, IndicatorObjectEntry * entry, guint old_pos, guint new_pos);
+void window_menu_emit_error_state (WindowMenu * wm, gboolean state);
+void window_menu_emit_status_changed (WindowMenu * wm, WindowMenuStatus status);
+void window_menu_emit_show_menu (WindowMenu * wm, IndicatorObjectEntry * entry, guint timestamp);
+void window_menu_emit_a11y_update (WindowMenu * wm, IndicatorObjectEntry * entry);
+
 G_END_DECLS
 
 #endif
@@ -0,0 +1,239 @@
+/*
+A small open addressing table keyed by X window IDs.
+
+Copyright 2017 Ayatana Indicators Project
+
+This program is free software: you can redistribute it and/or modify it 
+under the terms of the GNU General Public License version 3, as published 
+by the Free Software Foundation.
+
+This program is distributed in the hope that it will be useful, but 
+WITHOUT ANY WARRANTY; without even the implied warranties of 
+MERCHANTABILITY, SATISFACTORY QUALITY, or FITNESS FOR A PARTICULAR 
+PURPOSE.  See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along 
+with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <string.h>
+
+#include "xid-table.h"
+
+/* Entries live inline in one array with linear probing, so a lookup
+   touches a cache line or two instead of chasing hash nodes.  Removal
+   shifts the following run back rather than leaving tombstones. */
+
+#define XID_TABLE_MIN_BITS  4
+
+struct _XidTable {
+	XidTableEntry * slots;
+	guint bits;
+	guint mask;
+	guint size;
+	GDestroyNotify data_free;
+};
+
+static inline guint
+xid_hash (XidTable * table, guint32 xid)
+{
+	/* XIDs are mostly sequential within a client.  The multiply mixes
+	   the low bits up into the high ones, so those are what we take;
+	   the low bits of the product are just the XID's own, shuffled. */
+	return (guint32)(xid * 2654435761u) >> (32 - table->bits);
+}
+
+XidTable *
+xid_table_new (GDestroyNotify data_free)
+{
+	XidTable * table = g_new0(XidTable, 1);
+
+	table->bits = XID_TABLE_MIN_BITS;
+	table->slots = g_new0(XidTableEntry, 1 << table->bits);
+	table->mask = (1 << table->bits) - 1;
+	table->size = 0;
+	table->data_free = data_free;
+
+	return table;
+}
+
+/* Frees the table, passing any data still in it to the destroy
+   function */
+void
+xid_table_free (XidTable * table)
+{
+	g_return_if_fail(table != NULL);
+
+	if (table->data_free != NULL) {
+		guint i;
+		for (i = 0; i <= table->mask; i++) {
+			if (table->slots[i].xid != 0 && table->slots[i].data != NULL) {
+				table->data_free(table->slots[i].data);
+			}
+		}
+	}
+
+	g_free(table->slots);
+	g_free(table);
+
+	return;
+}
+
+guint
+xid_table_size (XidTable * table)
+{
+	g_return_val_if_fail(table != NULL, 0);
+	return table->size;
+}
+
+XidTableEntry *
+xid_table_lookup (XidTable * table, guint32 xid)
+{
+	g_return_val_if_fail(table != NULL, NULL);
+
+	if (xid == 0) {
+		return NULL;
+	}
+
+	guint i = xid_hash(table, xid);
+
+	while (table->slots[i].xid != 0) {
+		if (table->slots[i].xid == xid) {
+			return &table->slots[i];
+		}
+		i = (i + 1) & table->mask;
+	}
+
+	return NULL;
+}
+
+static void
+xid_table_grow (XidTable * table)
+{
+	XidTableEntry * old = table->slots;
+	guint old_count = table->mask + 1;
+	guint i;
+
+	table->bits++;
+	table->slots = g_new0(XidTableEntry, old_count * 2);
+	table->mask = old_count * 2 - 1;
+
+	for (i = 0; i < old_count; i++) {
+		if (old[i].xid == 0) {
+			continue;
+		}
+
+		guint j = xid_hash(table, old[i].xid);
+		while (table->slots[j].xid != 0) {
+			j = (j + 1) & table->mask;
+		}
+		table->slots[j] = old[i];
+	}
+
+	g_free(old);
+	return;
+}
+
+/* Gets the entry for a window, adding an empty one if there isn't
+   one already.  Entry pointers are only good until the next insert
+   or remove. */
+XidTableEntry *
+xid_table_insert (XidTable * table, guint32 xid)
+{
+	g_return_val_if_fail(table != NULL, NULL);
+	g_return_val_if_fail(xid != 0, NULL);
+
+	XidTableEntry * entry = xid_table_lookup(table, xid);
+	if (entry != NULL) {
+		return entry;
+	}
+
+	/* Keep the load under three quarters so probe runs stay short */
+	if ((table->size + 1) * 4 > (table->mask + 1) * 3) {
+		xid_table_grow(table);
+	}
+
+	guint i = xid_hash(table, xid);
+	while (table->slots[i].xid != 0) {
+		i = (i + 1) & table->mask;
+	}
+
+	memset(&table->slots[i], 0, sizeof(XidTableEntry));
+	table->slots[i].xid = xid;
+	table->size++;
+
+	return &table->slots[i];
+}
+
+/* Removes the entry for a window.  The data is the caller's to deal
+   with, it's not passed to the destroy function. */
+void
+xid_table_remove (XidTable * table, guint32 xid)
+{
+	g_return_if_fail(table != NULL);
+
+	XidTableEntry * entry = xid_table_lookup(table, xid);
+	if (entry == NULL) {
+		return;
+	}
+
+	guint hole = entry - table->slots;
+	guint i = (hole + 1) & table->mask;
+
+	/* Pull back any entry further along the run that would still be
+	   reachable from its home slot through the hole */
+	while (table->slots[i].xid != 0) {
+		guint home = xid_hash(table, table->slots[i].xid);
+
+		if (((i - home) & table->mask) >= ((i - hole) & table->mask)) {
+			table->slots[hole] = table->slots[i];
+			hole = i;
+		}
+
+		i = (i + 1) & table->mask;
+	}
+
+	memset(&table->slots[hole], 0, sizeof(XidTableEntry));
+	table->size--;
+
+	return;
+}
+
+/* Iteration doesn't allocate, but the table can't be changed while
+   it's going on */
+void
+xid_table_iter_init (XidTableIter * iter, XidTable * table)
+{
+	g_return_if_fail(iter != NULL);
+	g_return_if_fail(table != NULL);
+
+	iter->table = table;
+	iter->index = 0;
+
+	return;
+}
+
+gboolean
+xid_table_iter_next (XidTableIter * iter, XidTableEntry ** entry)
+{
+	g_return_val_if_fail(iter != NULL, FALSE);
+
+	XidTable * table = iter->table;
+
+	while (iter->index <= table->mask) {
+		XidTableEntry * slot = &table->slots[iter->index++];
+
+		if (slot->xid != 0) {
+			if (entry != NULL) {
+				*entry = slot;
+			}
+			return TRUE;
+		}
+	}
+
+	return FALSE;
+}
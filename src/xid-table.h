@@ -0,0 +1,62 @@
+/*
+A small open addressing table keyed by X window IDs.
+
+Copyright 2017 Ayatana Indicators Project
+
+This program is free software: you can redistribute it and/or modify it 
+under the terms of the GNU General Public License version 3, as published 
+by the Free Software Foundation.
+
+This program is distributed in the hope that it will be useful, but 
+WITHOUT ANY WARRANTY; without even the implied warranties of 
+MERCHANTABILITY, SATISFACTORY QUALITY, or FITNESS FOR A PARTICULAR 
+PURPOSE.  See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along 
+with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __XID_TABLE_H__
+#define __XID_TABLE_H__
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/* Window ID zero is never a real window, it marks empty slots */
+
+typedef enum _XidTableFlags XidTableFlags;
+enum _XidTableFlags {
+	XID_TABLE_FLAG_DESKTOP = 1 << 0
+};
+
+typedef struct _XidTableEntry XidTableEntry;
+struct _XidTableEntry {
+	guint32 xid;
+	guint16 flags;
+	guint16 backend;
+	gpointer data;
+};
+
+typedef struct _XidTable XidTable;
+
+typedef struct _XidTableIter XidTableIter;
+struct _XidTableIter {
+	XidTable * table;
+	guint index;
+};
+
+XidTable * xid_table_new (GDestroyNotify data_free);
+void xid_table_free (XidTable * table);
+
+guint xid_table_size (XidTable * table);
+XidTableEntry * xid_table_lookup (XidTable * table, guint32 xid);
+XidTableEntry * xid_table_insert (XidTable * table, guint32 xid);
+void xid_table_remove (XidTable * table, guint32 xid);
+
+void xid_table_iter_init (XidTableIter * iter, XidTable * table);
+gboolean xid_table_iter_next (XidTableIter * iter, XidTableEntry ** entry);
+
+G_END_DECLS
+
+#endif
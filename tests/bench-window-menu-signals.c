@@ -0,0 +1,96 @@
+/*
+Compares emitting the entry signals by id with emitting them by name.
+
+Copyright 2017 Ayatana Indicators Project
+
+This program is free software: you can redistribute it and/or modify it
+under the terms of the GNU General Public License version 3, as published
+by the Free Software Foundation.
+
+This program is distributed in the hope that it will be useful, but
+WITHOUT ANY WARRANTY; without even the implied warranties of
+MERCHANTABILITY, SATISFACTORY QUALITY, or FITNESS FOR A PARTICULAR
+PURPOSE.  See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <glib.h>
+#include <glib-object.h>
+
+#include "window-menu.h"
+
+#define EMISSIONS  1000000
+
+/* Keeps the compiler from dropping the loops */
+static volatile guintptr sink;
+
+static void
+entry_handler (WindowMenu * wm, IndicatorObjectEntry * entry, gpointer user_data)
+{
+	sink += (guintptr)entry;
+	return;
+}
+
+static gdouble
+ns_per (gint64 start, guint count)
+{
+	return (gdouble)(g_get_monotonic_time() - start) * 1000.0 / count;
+}
+
+/* The way indicator-appmenu used to send them on, looking the
+   signal up by name and going through the generic marshaller */
+static void
+emit_by_name (WindowMenu * wm, const gchar * signal, IndicatorObjectEntry * entry)
+{
+	g_signal_emit_by_name(wm, signal, entry);
+	return;
+}
+
+static void
+bench (guint handlers)
+{
+	WindowMenu * wm = g_object_new(WINDOW_MENU_TYPE, NULL);
+	IndicatorObjectEntry entry = { 0 };
+	guint i;
+	gint64 start;
+
+	for (i = 0; i < handlers; i++) {
+		g_signal_connect(wm, WINDOW_MENU_SIGNAL_ENTRY_ADDED, G_CALLBACK(entry_handler), NULL);
+		g_signal_connect(wm, WINDOW_MENU_SIGNAL_ENTRY_REMOVED, G_CALLBACK(entry_handler), NULL);
+	}
+
+	start = g_get_monotonic_time();
+	for (i = 0; i < EMISSIONS; i++) {
+		window_menu_emit_entry_added(wm, &entry);
+		window_menu_emit_entry_removed(wm, &entry);
+	}
+	gdouble by_id = ns_per(start, EMISSIONS * 2);
+
+	start = g_get_monotonic_time();
+	for (i = 0; i < EMISSIONS; i++) {
+		emit_by_name(wm, WINDOW_MENU_SIGNAL_ENTRY_ADDED, &entry);
+		emit_by_name(wm, WINDOW_MENU_SIGNAL_ENTRY_REMOVED, &entry);
+	}
+	gdouble by_name = ns_per(start, EMISSIONS * 2);
+
+	g_print("%2u handlers   by id %6.1f ns   by name %6.1f ns\n",
+	        handlers, by_id, by_name);
+
+	g_object_unref(wm);
+
+	return;
+}
+
+gint
+main (gint argc, gchar * argv[])
+{
+	g_print("Entry signal emission\n");
+
+	bench(0);
+	bench(1);
+	bench(4);
+
+	return 0;
+}
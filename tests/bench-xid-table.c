@@ -0,0 +1,114 @@
+/*
+Compares the XID keyed table with the GHashTables it replaced.
+
+Copyright 2017 Ayatana Indicators Project
+
+This program is free software: you can redistribute it and/or modify it
+under the terms of the GNU General Public License version 3, as published
+by the Free Software Foundation.
+
+This program is distributed in the hope that it will be useful, but
+WITHOUT ANY WARRANTY; without even the implied warranties of
+MERCHANTABILITY, SATISFACTORY QUALITY, or FITNESS FOR A PARTICULAR
+PURPOSE.  See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <glib.h>
+
+#include "xid-table.h"
+
+#define XID_BASE    0x3c00001
+#define LOOKUPS     1000000
+#define ITERATIONS  10000
+
+/* Keeps the compiler from dropping the loops */
+static volatile guintptr sink;
+
+/* Windows of a few clients, each counting up from its own base */
+static guint32
+window_xid (guint i)
+{
+	return XID_BASE + (i % 4) * 0x200000 + (i / 4) * 3;
+}
+
+static gdouble
+ns_per (gint64 start, guint count)
+{
+	return (gdouble)(g_get_monotonic_time() - start) * 1000.0 / count;
+}
+
+static void
+bench (guint windows)
+{
+	XidTable * table = xid_table_new(NULL);
+	GHashTable * hash = g_hash_table_new(g_direct_hash, g_direct_equal);
+	guint i, j;
+	gint64 start;
+
+	for (i = 0; i < windows; i++) {
+		xid_table_insert(table, window_xid(i))->data = GUINT_TO_POINTER(i + 1);
+		g_hash_table_insert(hash, GUINT_TO_POINTER(window_xid(i)), GUINT_TO_POINTER(i + 1));
+	}
+
+	/* Lookups */
+	start = g_get_monotonic_time();
+	for (i = 0; i < LOOKUPS; i++) {
+		sink += (guintptr)xid_table_lookup(table, window_xid(i % windows))->data;
+	}
+	gdouble table_lookup = ns_per(start, LOOKUPS);
+
+	start = g_get_monotonic_time();
+	for (i = 0; i < LOOKUPS; i++) {
+		sink += (guintptr)g_hash_table_lookup(hash, GUINT_TO_POINTER(window_xid(i % windows)));
+	}
+	gdouble hash_lookup = ns_per(start, LOOKUPS);
+
+	/* Walking everything, the hash table the way determine_new_desktop
+	   used to with a list of its keys */
+	start = g_get_monotonic_time();
+	for (j = 0; j < ITERATIONS; j++) {
+		XidTableIter iter;
+		XidTableEntry * entry;
+
+		xid_table_iter_init(&iter, table);
+		while (xid_table_iter_next(&iter, &entry)) {
+			sink += entry->xid;
+		}
+	}
+	gdouble table_iter = ns_per(start, ITERATIONS);
+
+	start = g_get_monotonic_time();
+	for (j = 0; j < ITERATIONS; j++) {
+		GList * keys = g_hash_table_get_keys(hash);
+		GList * l;
+
+		for (l = keys; l != NULL; l = l->next) {
+			sink += GPOINTER_TO_UINT(l->data);
+		}
+		g_list_free(keys);
+	}
+	gdouble hash_iter = ns_per(start, ITERATIONS);
+
+	g_print("%5u windows   lookup %6.1f ns vs %6.1f ns   walk %9.1f ns vs %9.1f ns\n",
+	        windows, table_lookup, hash_lookup, table_iter, hash_iter);
+
+	g_hash_table_destroy(hash);
+	xid_table_free(table);
+
+	return;
+}
+
+gint
+main (gint argc, gchar * argv[])
+{
+	g_print("XidTable vs GHashTable\n");
+
+	bench(10);
+	bench(100);
+	bench(1000);
+
+	return 0;
+}
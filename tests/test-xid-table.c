@@ -0,0 +1,179 @@
+/*
+Tests for the XID keyed table.
+
+Copyright 2017 Ayatana Indicators Project
+
+This program is free software: you can redistribute it and/or modify it
+under the terms of the GNU General Public License version 3, as published
+by the Free Software Foundation.
+
+This program is distributed in the hope that it will be useful, but
+WITHOUT ANY WARRANTY; without even the implied warranties of
+MERCHANTABILITY, SATISFACTORY QUALITY, or FITNESS FOR A PARTICULAR
+PURPOSE.  See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <glib.h>
+
+#include "xid-table.h"
+
+/* XIDs the way an X server hands them out, a client base and then
+   counting up */
+#define XID_BASE  0x3c00001
+
+/* Every XID that's in is found with its data, and iterating gives
+   each of them once */
+static void
+check_contents (XidTable * table, GHashTable * expected)
+{
+	GHashTableIter hash_iter;
+	gpointer key, value;
+
+	g_assert_cmpuint(xid_table_size(table), ==, g_hash_table_size(expected));
+
+	g_hash_table_iter_init(&hash_iter, expected);
+	while (g_hash_table_iter_next(&hash_iter, &key, &value)) {
+		XidTableEntry * entry = xid_table_lookup(table, GPOINTER_TO_UINT(key));
+
+		g_assert(entry != NULL);
+		g_assert_cmpuint(entry->xid, ==, GPOINTER_TO_UINT(key));
+		g_assert(entry->data == value);
+	}
+
+	XidTableIter iter;
+	XidTableEntry * entry;
+	guint count = 0;
+
+	xid_table_iter_init(&iter, table);
+	while (xid_table_iter_next(&iter, &entry)) {
+		g_assert(g_hash_table_contains(expected, GUINT_TO_POINTER(entry->xid)));
+		count++;
+	}
+	g_assert_cmpuint(count, ==, g_hash_table_size(expected));
+
+	return;
+}
+
+static void
+test_insert_lookup (void)
+{
+	XidTable * table = xid_table_new(NULL);
+	GHashTable * expected = g_hash_table_new(g_direct_hash, g_direct_equal);
+	guint i;
+
+	g_assert(xid_table_lookup(table, XID_BASE) == NULL);
+	g_assert(xid_table_lookup(table, 0) == NULL);
+
+	/* Enough to grow a few times */
+	for (i = 0; i < 1000; i++) {
+		guint32 xid = XID_BASE + i;
+		XidTableEntry * entry = xid_table_insert(table, xid);
+
+		g_assert(entry != NULL);
+		g_assert(entry->data == NULL);
+		g_assert_cmpuint(entry->flags, ==, 0);
+		entry->data = GUINT_TO_POINTER(i + 1);
+
+		g_hash_table_insert(expected, GUINT_TO_POINTER(xid), GUINT_TO_POINTER(i + 1));
+	}
+
+	check_contents(table, expected);
+
+	/* Inserting again hands back the same entry */
+	XidTableEntry * entry = xid_table_insert(table, XID_BASE + 10);
+	g_assert(entry->data == GUINT_TO_POINTER(11));
+	g_assert_cmpuint(xid_table_size(table), ==, 1000);
+
+	g_hash_table_destroy(expected);
+	xid_table_free(table);
+
+	return;
+}
+
+/* Removing shifts the rest of a probe run back, check that nothing
+   behind a hole gets lost whichever order things go in and out */
+static void
+test_remove (void)
+{
+	XidTable * table = xid_table_new(NULL);
+	GHashTable * expected = g_hash_table_new(g_direct_hash, g_direct_equal);
+	GRand * rand = g_rand_new_with_seed(42);
+	guint i;
+
+	for (i = 0; i < 20000; i++) {
+		/* A small key space keeps the runs long and busy */
+		guint32 xid = XID_BASE + g_rand_int_range(rand, 0, 300);
+
+		if (g_rand_boolean(rand)) {
+			xid_table_insert(table, xid)->data = GUINT_TO_POINTER(xid);
+			g_hash_table_insert(expected, GUINT_TO_POINTER(xid), GUINT_TO_POINTER(xid));
+		} else {
+			xid_table_remove(table, xid);
+			g_hash_table_remove(expected, GUINT_TO_POINTER(xid));
+			g_assert(xid_table_lookup(table, xid) == NULL);
+		}
+
+		if (i % 100 == 0) {
+			check_contents(table, expected);
+		}
+	}
+
+	check_contents(table, expected);
+
+	/* Empty it out completely */
+	for (i = 0; i < 300; i++) {
+		xid_table_remove(table, XID_BASE + i);
+	}
+	g_assert_cmpuint(xid_table_size(table), ==, 0);
+
+	g_rand_free(rand);
+	g_hash_table_destroy(expected);
+	xid_table_free(table);
+
+	return;
+}
+
+static guint freed = 0;
+
+static void
+count_free (gpointer data)
+{
+	freed++;
+	return;
+}
+
+/* Freeing the table hands over what's left, removing doesn't */
+static void
+test_free (void)
+{
+	XidTable * table = xid_table_new(count_free);
+	guint i;
+
+	for (i = 0; i < 10; i++) {
+		xid_table_insert(table, XID_BASE + i)->data = GUINT_TO_POINTER(1);
+	}
+	xid_table_insert(table, XID_BASE + 10);
+
+	xid_table_remove(table, XID_BASE);
+	g_assert_cmpuint(freed, ==, 0);
+
+	xid_table_free(table);
+	g_assert_cmpuint(freed, ==, 9);
+
+	return;
+}
+
+gint
+main (gint argc, gchar * argv[])
+{
+	g_test_init(&argc, &argv, NULL);
+
+	g_test_add_func("/xid-table/insert-lookup", test_insert_lookup);
+	g_test_add_func("/xid-table/remove", test_remove);
+	g_test_add_func("/xid-table/free", test_free);
+
+	return g_test_run();
+}